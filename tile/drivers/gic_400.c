@@ -22,6 +22,7 @@ void gic_init() {
   /* Ensure that each interrupt has a distinct priority. */
   gic_set_interrupt_priority(TIM01INT, 0);
   gic_set_interrupt_priority(UART0INTR, 1);
+  gic_set_interrupt_priority(MCI_INTR_0, 2);
 
   /* Set the priority mask to lowest priority. */
   gicc->pm = 0xff;
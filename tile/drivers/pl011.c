@@ -76,7 +76,7 @@ void uart_init() {
   uart.term = term;
 
   /* Initialize the terminal device. */
-  term_dev = memory_alloc(sizeof(struct device));
+  term_dev = kmem_cache_alloc(&device_cache);
   strcpy(term_dev->name, uart_device.name);
   term_dev->ops = &terminal_operations;
   term_dev->major = uart_device.major;
@@ -1,11 +1,38 @@
 /*
   pl180.c provides an ARM PrimeCell Multimedia Card Interface (PL180) driver.
+
+  The SD card is exposed as a block device, and the block layer hands it one
+  request at a time. Commands are polled as they finish quickly, but data
+  transfers are driven by the FIFO interrupts so that the issuing process can
+  sleep while the rest of the system runs.
 */
 
 #include <drivers/pl180.h>
+#include <kernel/asm/processor.h>
+#include <kernel/processor.h>
 
 volatile struct mci_registers* mci = (volatile struct mci_registers*)MCI_PADDR;
 
+struct mci_transfer mci_transfer = {.done = COMPLETION_INIT(mci_transfer.done)};
+
+struct block_operations mci_block_operations = {
+  .transfer = mci_transfer_request
+};
+
+/*
+  The SD card is the first block device, so it holds the root filesystem.
+*/
+struct block_device mci_block_device = {
+  .dev = {
+    .name = "mmcblk0",
+    .major = 179,
+    .minor = 0
+  },
+  .ops = &mci_block_operations,
+  .max_sectors = MCI_MAX_BLOCKS,
+  .private = &mci_transfer
+};
+
 /*
   mci_init initializes the multimedia card interface.
 */
@@ -30,42 +57,145 @@ void mci_init() {
 
   /* SET_BLOCKLEN */
   mci_send_command(16, MCI_COMMAND_ENABLE | MCI_COMMAND_RESPONSE, MCI_BLOCK_SIZE);
+
+  block_device_register(&mci_block_device);
 }
 
 /*
-  mci_read reads MCI_BLOCK_SIZE bytes from the SD card at the address "addr"
-  and stores them in the buffer "buf". The number of bytes read is returned.
+  mci_transfer_request performs the block request "req" on the SD card for the
+  block device "bdev". More than one block is transferred with a single
+  READ_MULTIPLE_BLOCK or WRITE_MULTIPLE_BLOCK command which is ended with
+  STOP_TRANSMISSION. The data is moved by do_mci_irq as the FIFO fills or
+  drains, and the calling process sleeps until the transfer ends. If
+  interrupts are disabled, such as during boot, then do_mci_irq is polled
+  instead. It returns 0 on success and -1 on failure.
 */
-size_t mci_read(uint32_t addr, char* buf) {
-  /* READ_SINGLE_BLOCK */
-  mci_send_command(17, MCI_COMMAND_ENABLE | MCI_COMMAND_RESPONSE, addr);
-  mci->data_length = MCI_BLOCK_SIZE;
-  mci->data_ctrl = 0x3;
+int mci_transfer_request(struct block_device* bdev, struct block_request* req) {
+  struct bio* bio;
+  uint32_t cmd_index;
+  uint32_t data_ctrl;
+  uint32_t mask;
+  uint32_t cpsr;
+
+  if (!req->count || req->count > MCI_MAX_BLOCKS) {
+    return -1;
+  }
 
-  for (size_t i = 0; i < MCI_BLOCK_SIZE / 4; ++i) {
-    while (!(mci->status & MCI_STATUS_DATA_BLOCK_END));
-    ((uint32_t*)buf)[i] = mci->fifo[0];
+  if (req->op == BIO_READ) {
+    /* READ_SINGLE_BLOCK or READ_MULTIPLE_BLOCK */
+    cmd_index = req->count == 1 ? 17 : 18;
+    data_ctrl = MCI_DATA_CTRL_ENABLE | MCI_DATA_CTRL_READ | MCI_DATA_CTRL_BLOCK_SIZE;
+    mask = MCI_STATUS_RX_FIFO_HALF_FULL;
+  }
+  else {
+    /* WRITE_BLOCK or WRITE_MULTIPLE_BLOCK */
+    cmd_index = req->count == 1 ? 24 : 25;
+    data_ctrl = MCI_DATA_CTRL_ENABLE | MCI_DATA_CTRL_BLOCK_SIZE;
+    mask = MCI_STATUS_TX_FIFO_HALF_EMPTY;
   }
 
-  return MCI_BLOCK_SIZE;
+  bio = list_data(req->bios_head.next, struct bio, link);
+
+  mci_transfer.bios_head = &req->bios_head;
+  mci_transfer.bio = &bio->link;
+  mci_transfer.buf = (uint32_t*)bio->data;
+  mci_transfer.count = bio->count * MCI_BLOCK_SIZE / 4;
+  mci_transfer.left = req->count * MCI_BLOCK_SIZE / 4;
+  mci_transfer.read = req->op == BIO_READ;
+  mci_transfer.error = false;
+
+  mci->clear = MCI_CLEAR_STATIC;
+
+  if (mci_send_command(cmd_index, MCI_COMMAND_ENABLE | MCI_COMMAND_RESPONSE, MCI_BLOCK_SIZE * req->sector) < 0) {
+    return -1;
+  }
+
+  cpsr = save_interrupts();
+
+  mci->data_length = req->count * MCI_BLOCK_SIZE;
+  mci->mask[0] = mask | MCI_STATUS_DATA_END | MCI_STATUS_DATA_ERROR;
+  mci->data_ctrl = data_ctrl;
+
+  if (cpsr & PSR_I) {
+    while (!is_completion_done(&mci_transfer.done)) {
+      do_mci_irq();
+    }
+  }
+
+  restore_interrupts(cpsr);
+  completion_wait(&mci_transfer.done);
+
+  if (req->count > 1) {
+    /* STOP_TRANSMISSION */
+    mci_send_command(12, MCI_COMMAND_ENABLE | MCI_COMMAND_RESPONSE, 0);
+  }
+
+  if (mci_transfer.error) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+  mci_transfer_advance accounts for a word of the current transfer which was
+  moved, and continues with the next bio once the current one is done.
+*/
+void mci_transfer_advance() {
+  struct bio* bio;
+
+  ++mci_transfer.buf;
+  --mci_transfer.count;
+  --mci_transfer.left;
+
+  if (mci_transfer.count || !mci_transfer.left) {
+    return;
+  }
+
+  mci_transfer.bio = mci_transfer.bio->next;
+  bio = list_data(mci_transfer.bio, struct bio, link);
+  mci_transfer.buf = (uint32_t*)bio->data;
+  mci_transfer.count = bio->count * MCI_BLOCK_SIZE / 4;
 }
 
 /*
-  mci_write writes MCI_BLOCK_SIZE bytes from the buffer "buf" to the SD card
-  at the address "addr". The number of bytes written is returned.
+  do_mci_irq handles a multimedia card interface IRQ exception. It moves as
+  many words of the current transfer as the FIFO allows, and completes the
+  transfer when the data path ends or fails.
 */
-size_t mci_write(uint32_t addr, const char* buf) {
-  /* WRITE_BLOCK */
-  mci_send_command(24, MCI_COMMAND_ENABLE | MCI_COMMAND_RESPONSE, addr);
-  mci->data_length = MCI_BLOCK_SIZE;
-  mci->data_ctrl = 0x1;
+void do_mci_irq() {
+  uint32_t status;
+
+  if (mci_transfer.read) {
+    while (mci_transfer.left && mci->status & MCI_STATUS_RX_DATA_AVAILABLE) {
+      *mci_transfer.buf = mci->fifo[0];
+      mci_transfer_advance();
+    }
+  }
+  else {
+    while (mci_transfer.left && !(mci->status & MCI_STATUS_TX_FIFO_FULL)) {
+      mci->fifo[0] = *mci_transfer.buf;
+      mci_transfer_advance();
+    }
+
+    /* Once every word is in the FIFO, only the end of the transfer matters. */
+    if (!mci_transfer.left) {
+      mci->mask[0] &= ~MCI_STATUS_TX_FIFO_HALF_EMPTY;
+    }
+  }
 
-  for (size_t i = 0; i < MCI_BLOCK_SIZE / 4; ++i) {
-    while (!(mci->status & MCI_STATUS_DATA_BLOCK_END));
-    mci->fifo[0] = ((uint32_t*)buf)[i];
+  status = mci->status;
+
+  if (status & MCI_STATUS_DATA_ERROR) {
+    mci_transfer.error = true;
+  }
+  else if (!(status & MCI_STATUS_DATA_END) || mci_transfer.left) {
+    return;
   }
 
-  return MCI_BLOCK_SIZE;
+  mci->mask[0] = 0;
+  mci->clear = MCI_CLEAR_STATIC;
+  complete(&mci_transfer.done);
 }
 
 /*
@@ -73,10 +203,13 @@ size_t mci_write(uint32_t addr, const char* buf) {
   contains a command index "cmd_index" which specifies which command to
   perform, command type "cmd_type" which specifies the operation of the command
   path state machine, and a command argument "cmd_arg" which specifies an
-  argument for the command.
+  argument for the command. It waits until the command is sent, or until its
+  response is received if it has one, and returns -1 if the command failed.
 */
 int mci_send_command(uint32_t cmd_index, uint32_t cmd_type, uint32_t cmd_arg) {
   uint32_t command = 0;
+  uint32_t end;
+  uint32_t status;
 
   if (cmd_index > 63) {
     return -1;
@@ -87,5 +220,27 @@ int mci_send_command(uint32_t cmd_index, uint32_t cmd_type, uint32_t cmd_arg) {
   mci->argument = cmd_arg;
   mci->command = command;
 
+  if (!(cmd_type & MCI_COMMAND_ENABLE)) {
+    return 0;
+  }
+
+  if (cmd_type & MCI_COMMAND_RESPONSE) {
+    end = MCI_STATUS_CMD_RESP_END;
+  }
+  else {
+    end = MCI_STATUS_CMD_SENT;
+  }
+
+  /* Commands finish within a few card clock cycles, so they are polled. */
+  do {
+    status = mci->status;
+  } while (!(status & (end | MCI_STATUS_CMD_ERROR)));
+
+  mci->clear = MCI_CLEAR_COMMAND;
+
+  if (status & MCI_STATUS_CMD_ERROR) {
+    return -1;
+  }
+
   return 0;
 }
@@ -2,18 +2,48 @@
 #define MCI_H
 
 #include <kernel/asm/memory.h>
+#include <kernel/block.h>
+#include <kernel/wait.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define MCI_BLOCK_SIZE 512
 
+/* The data length register is 16 bits wide. */
+#define MCI_MAX_BLOCKS 64
+
 #define MCI_COMMAND_RESPONSE (1 << 6)
 #define MCI_COMMAND_LONG_RSP (1 << 7)
 #define MCI_COMMAND_INTERRUPT (1 << 8)
 #define MCI_COMMAND_PENDING (1 << 9)
 #define MCI_COMMAND_ENABLE (1 << 10)
 
+#define MCI_DATA_CTRL_ENABLE (1 << 0)
+#define MCI_DATA_CTRL_READ (1 << 1)
+#define MCI_DATA_CTRL_BLOCK_SIZE (9 << 4)
+
+#define MCI_STATUS_CMD_CRC_FAIL (1 << 0)
+#define MCI_STATUS_DATA_CRC_FAIL (1 << 1)
+#define MCI_STATUS_CMD_TIME_OUT (1 << 2)
+#define MCI_STATUS_DATA_TIME_OUT (1 << 3)
+#define MCI_STATUS_TX_UNDERRUN (1 << 4)
+#define MCI_STATUS_RX_OVERRUN (1 << 5)
+#define MCI_STATUS_CMD_RESP_END (1 << 6)
+#define MCI_STATUS_CMD_SENT (1 << 7)
+#define MCI_STATUS_DATA_END (1 << 8)
+#define MCI_STATUS_START_BIT_ERR (1 << 9)
 #define MCI_STATUS_DATA_BLOCK_END (1 << 10)
+#define MCI_STATUS_TX_FIFO_HALF_EMPTY (1 << 14)
+#define MCI_STATUS_RX_FIFO_HALF_FULL (1 << 15)
+#define MCI_STATUS_TX_FIFO_FULL (1 << 16)
+#define MCI_STATUS_RX_DATA_AVAILABLE (1 << 21)
+
+#define MCI_STATUS_CMD_ERROR (MCI_STATUS_CMD_CRC_FAIL | MCI_STATUS_CMD_TIME_OUT)
+#define MCI_STATUS_DATA_ERROR (MCI_STATUS_DATA_CRC_FAIL | MCI_STATUS_DATA_TIME_OUT | MCI_STATUS_TX_UNDERRUN | MCI_STATUS_RX_OVERRUN | MCI_STATUS_START_BIT_ERR)
+
+#define MCI_CLEAR_COMMAND (MCI_STATUS_CMD_ERROR | MCI_STATUS_CMD_RESP_END | MCI_STATUS_CMD_SENT)
+#define MCI_CLEAR_STATIC 0x7ff
 
 extern volatile struct mci_registers* mci;
 
@@ -44,10 +74,35 @@ struct mci_registers {
   uint32_t p_cell_d[4];
 };
 
+/*
+  struct mci_transfer represents the data transfer in progress. It moves the
+  data of the bios in "bios_head", of which "bio" is the current one. "buf" is
+  the next word of the current bio to be read into or written from, "count" is
+  the number of words left in it, and "left" is the number of words left in
+  the whole transfer. "error" is set if the transfer failed, and "done" is
+  completed by the interrupt handler when the transfer ends.
+*/
+struct mci_transfer {
+  struct list_link* bios_head;
+  struct list_link* bio;
+  uint32_t* buf;
+  size_t count;
+  size_t left;
+  bool read;
+  bool error;
+  struct completion done;
+};
+
+extern struct mci_transfer mci_transfer;
+extern struct block_operations mci_block_operations;
+extern struct block_device mci_block_device;
+
 void mci_init();
 
-size_t mci_read(uint32_t addr, char* buf);
-size_t mci_write(uint32_t addr, const char* buf);
+int mci_transfer_request(struct block_device* bdev, struct block_request* req);
+void mci_transfer_advance();
+
+void do_mci_irq();
 
 int mci_send_command(uint32_t cmd_index, uint32_t cmd_type, uint32_t cmd_arg);
 
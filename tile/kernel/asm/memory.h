@@ -33,9 +33,28 @@
 #define PG_DIR_SIZE 0x00004000
 #define PG_DIR_PADDR (KERNEL_SPACE_PADDR + PG_DIR_SIZE)
 
+/*
+  TTBCR.N splits the virtual address space between the two translation table
+  base registers. Addresses below USER_VADDR_END are translated by TTBR0 using
+  a per-process table of USER_PG_DIR_SIZE, and the rest are translated by TTBR1
+  using the initial page global directory.
+*/
+#define TTBCR_N 1
+#define USER_VADDR_END 0x80000000
+#define USER_PG_DIR_SIZE (PG_DIR_SIZE >> TTBCR_N)
+
+/*
+  A process's stack begins at STACK_TOP and grows down on demand to at most
+  STACK_MAX_SIZE bytes. It never grows to within STACK_GUARD_SIZE bytes of the
+  mapping below it.
+*/
+#define STACK_TOP USER_VADDR_END
+#define STACK_MAX_SIZE 0x00800000
+#define STACK_GUARD_SIZE 0x00001000
+
 #define VMALLOC_OFFSET 0x800000
 #define VMALLOC_MIN_VADDR 0xf0000000
-#define VMALLOC_BEGIN_VADDR high_memory + VMALLOC_OFFSET
+#define VMALLOC_BEGIN_VADDR (high_memory + VMALLOC_OFFSET)
 #define VMALLOC_END_VADDR 0xff800000
 
 #endif
@@ -8,9 +8,12 @@
 #define VADDR_SPACE_END 0xffffffff
 
 #define PMD_SIZE 0x100000
+#define LARGE_PAGE_SIZE 0x10000
 #define PAGE_SIZE 0x1000
 #define PAGE_TABLE_SIZE 0x400
 #define PAGES_PER_PAGE_TABLE (PAGE_TABLE_SIZE / 4)
+#define PAGES_PER_LARGE_PAGE (LARGE_PAGE_SIZE / PAGE_SIZE)
+#define PAGES_PER_SECTION (PMD_SIZE / PAGE_SIZE)
 
 #define PG_DIR_SHIFT 0x14
 #define PAGE_SHIFT 0xc
@@ -24,4 +27,7 @@
 #define SECTION_AP_1 11
 #define SECTION_AP_2 15
 
+#define ASID_BITS 8
+#define ASID_MASK ((1 << ASID_BITS) - 1)
+
 #endif
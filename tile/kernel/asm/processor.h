@@ -12,4 +12,9 @@
 #define PM_UND 0x1b
 #define PM_SYS 0x1f
 
+/* Program status register bits. */
+#define PSR_F (1 << 6)
+#define PSR_I (1 << 7)
+#define PSR_A (1 << 8)
+
 #endif
@@ -0,0 +1,356 @@
+/*
+  block.c handles the block device layer.
+
+  Block I/O is described by bios, which are submitted to a block device's
+  queue. A bio which continues or precedes a queued request of the same
+  direction is merged into it, so that adjacent bios become a single transfer.
+  Otherwise it becomes a new request, and requests are kept in sector order.
+
+  The queue is dispatched by the first process which needs it while no other
+  process is dispatching it. Requests are dispatched in one direction: the
+  next one is the lowest request at or after the end of the last one, wrapping
+  around to the lowest request once none are left after it. While a transfer
+  sleeps, other processes' bios are queued behind it and merged and sorted
+  before they are dispatched.
+*/
+
+#include <kernel/block.h>
+#include <kernel/processor.h>
+#include <lib/string.h>
+
+struct block_device* root_block_device = NULL;
+
+struct kmem_cache block_request_cache = KMEM_CACHE_INIT(block_request_cache, "block_request", sizeof(struct block_request), 0, NULL);
+
+struct file_operations block_file_operations = {
+  .read = block_file_read,
+  .write = block_file_write
+};
+
+/*
+  block_device_register initializes the block device "bdev" and registers it in
+  the block device table. The first registered block device becomes the root
+  block device.
+*/
+int block_device_register(struct block_device* bdev) {
+  list_init(&bdev->queue_head);
+  bdev->next_sector = 0;
+  bdev->active = false;
+
+  bdev->dev.ops = &block_file_operations;
+  bdev->dev.type = DT_BLOCK;
+  bdev->dev.private = bdev;
+
+  if (!root_block_device) {
+    root_block_device = bdev;
+  }
+
+  return device_register(&bdev->dev);
+}
+
+/*
+  bio_init initializes the bio "bio" for the operation "op" on the "count"
+  sectors beginning at the sector "sector" with the buffer "data".
+*/
+void bio_init(struct bio* bio, int op, uint32_t sector, char* data, size_t count) {
+  bio->op = op;
+  bio->sector = sector;
+  bio->count = count;
+  bio->data = data;
+  bio->status = 0;
+  completion_init(&bio->done);
+}
+
+/*
+  submit_bio queues the bio "bio" on the block device "bdev". The bio isn't
+  dispatched until block_dispatch is called, so that more bios can be queued
+  and merged first. If it can't be queued, then it is ended with an error.
+*/
+void submit_bio(struct block_device* bdev, struct bio* bio) {
+  uint32_t cpsr;
+
+  cpsr = save_interrupts();
+  ++bdev->stats.bios;
+
+  if (!bio->count || bio->count > bdev->max_sectors || block_queue_bio(bdev, bio) < 0) {
+    bio_end(bio, -1);
+  }
+
+  restore_interrupts(cpsr);
+}
+
+/*
+  bio_wait sleeps until the bio "bio" has finished and returns its status.
+*/
+int bio_wait(struct bio* bio) {
+  completion_wait(&bio->done);
+  return bio->status;
+}
+
+/*
+  bio_end finishes the bio "bio" with the status "status" and wakes its waiter.
+*/
+void bio_end(struct bio* bio, int status) {
+  bio->status = status;
+  complete(&bio->done);
+}
+
+/*
+  block_merge_bio tries to merge the bio "bio" into a queued request of the
+  block device "bdev" which it directly follows or precedes. It returns if the
+  bio was merged.
+*/
+bool block_merge_bio(struct block_device* bdev, struct bio* bio) {
+  struct list_link* curr;
+  struct block_request* req;
+
+  curr = bdev->queue_head.next;
+
+  while (curr != &bdev->queue_head) {
+    req = list_data(curr, struct block_request, link);
+    curr = curr->next;
+
+    if (req->op != bio->op || req->count + bio->count > bdev->max_sectors) {
+      continue;
+    }
+
+    if (req->sector + req->count == bio->sector) {
+      list_push(req->bios_head.prev, &bio->link);
+    }
+    else if (bio->sector + bio->count == req->sector) {
+      list_push(&req->bios_head, &bio->link);
+      req->sector = bio->sector;
+    }
+    else {
+      continue;
+    }
+
+    req->count += bio->count;
+    ++bdev->stats.merges;
+
+    return true;
+  }
+
+  return false;
+}
+
+/*
+  block_queue_bio adds the bio "bio" to the queue of the block device "bdev",
+  either by merging it or by inserting a new request in sector order. It
+  returns 0 on success and -1 on failure.
+*/
+int block_queue_bio(struct block_device* bdev, struct bio* bio) {
+  struct list_link* curr;
+  struct block_request* req;
+
+  if (block_merge_bio(bdev, bio)) {
+    return 0;
+  }
+
+  req = kmem_cache_alloc(&block_request_cache);
+
+  if (!req) {
+    return -1;
+  }
+
+  req->op = bio->op;
+  req->sector = bio->sector;
+  req->count = bio->count;
+  list_init(&req->bios_head);
+  list_push(&req->bios_head, &bio->link);
+
+  curr = bdev->queue_head.next;
+
+  while (curr != &bdev->queue_head && list_data(curr, struct block_request, link)->sector <= req->sector) {
+    curr = curr->next;
+  }
+
+  list_push(curr->prev, &req->link);
+
+  return 0;
+}
+
+/*
+  block_next_request removes and returns the next request to dispatch from the
+  queue of the block device "bdev". It is the lowest request which begins at or
+  after the end of the last dispatched one, or the lowest request if there is
+  none. If the queue is empty, then NULL is returned.
+*/
+struct block_request* block_next_request(struct block_device* bdev) {
+  struct list_link* curr;
+  struct block_request* req;
+
+  if (is_list_empty(&bdev->queue_head)) {
+    return NULL;
+  }
+
+  curr = bdev->queue_head.next;
+
+  while (curr != &bdev->queue_head && list_data(curr, struct block_request, link)->sector < bdev->next_sector) {
+    curr = curr->next;
+  }
+
+  if (curr == &bdev->queue_head) {
+    curr = bdev->queue_head.next;
+  }
+
+  req = list_data(curr, struct block_request, link);
+  list_remove(&bdev->queue_head, &req->link);
+
+  bdev->next_sector = req->sector + req->count;
+  ++bdev->stats.dispatches;
+
+  return req;
+}
+
+/*
+  block_dispatch sends the queued requests of the block device "bdev" to its
+  driver until the queue is empty, and ends their bios. If another process is
+  already dispatching the queue, then it returns straight away, as that
+  process also dispatches the requests which were queued after it started.
+*/
+void block_dispatch(struct block_device* bdev) {
+  struct block_request* req;
+  struct list_link* curr;
+  struct bio* bio;
+  uint32_t cpsr;
+  int status;
+
+  cpsr = save_interrupts();
+
+  if (bdev->active) {
+    restore_interrupts(cpsr);
+    return;
+  }
+
+  bdev->active = true;
+
+  while ((req = block_next_request(bdev))) {
+    restore_interrupts(cpsr);
+
+    status = bdev->ops->transfer(bdev, req);
+    curr = req->bios_head.next;
+
+    while (curr != &req->bios_head) {
+      bio = list_data(curr, struct bio, link);
+      curr = curr->next;
+      bio_end(bio, status);
+    }
+
+    kmem_cache_free(&block_request_cache, req);
+    cpsr = save_interrupts();
+  }
+
+  bdev->active = false;
+  restore_interrupts(cpsr);
+}
+
+/*
+  block_transfer performs the operation "op" on the "count" sectors beginning
+  at the sector "sector" of the block device "bdev" with the buffer "data". The
+  transfer is split into bios of at most the device's request size, which are
+  queued together before they are dispatched. It returns 0 on success and -1 on
+  failure.
+*/
+int block_transfer(struct block_device* bdev, int op, uint32_t sector, char* data, size_t count) {
+  struct bio bios[BLOCK_TRANSFER_BIOS];
+  size_t size;
+  size_t n;
+  int ret = 0;
+
+  while (count) {
+    for (n = 0; count && n < BLOCK_TRANSFER_BIOS; ++n) {
+      size = count < bdev->max_sectors ? count : bdev->max_sectors;
+
+      bio_init(&bios[n], op, sector, data, size);
+      submit_bio(bdev, &bios[n]);
+
+      sector += size;
+      data += size * SECTOR_SIZE;
+      count -= size;
+    }
+
+    block_dispatch(bdev);
+
+    for (size_t i = 0; i < n; ++i) {
+      if (bio_wait(&bios[i]) < 0) {
+        ret = -1;
+      }
+    }
+  }
+
+  return ret;
+}
+
+/*
+  block_file_read handles reading from block device files. It reads up to
+  "count" bytes at the file's offset into the buffer "buf" and returns the
+  number of bytes read.
+*/
+int block_file_read(struct file_info_int* file, char* buf, size_t count) {
+  if (!(file->ft->status & FS_READ)) {
+    return -1;
+  }
+
+  return block_file_transfer(file, buf, count, BIO_READ);
+}
+
+/*
+  block_file_write handles writing to block device files. It writes up to
+  "count" bytes from the buffer "buf" at the file's offset and returns the
+  number of bytes written.
+*/
+int block_file_write(struct file_info_int* file, const char* buf, size_t count) {
+  if (!(file->ft->status & FS_WRITE)) {
+    return -1;
+  }
+
+  return block_file_transfer(file, (char*)buf, count, BIO_WRITE);
+}
+
+/*
+  block_file_transfer performs the operation "op" on up to "count" bytes of the
+  block device file "file" at its offset with the buffer "buf". Device files
+  bypass the buffer cache and are accessed a sector at a time, so partial
+  sectors are read before they are written. It returns the number of bytes
+  transferred and advances the file's offset by it.
+*/
+int block_file_transfer(struct file_info_int* file, char* buf, size_t count, int op) {
+  struct block_device* bdev;
+  char sector[SECTOR_SIZE];
+  uint32_t offset;
+  size_t size;
+  int ret = 0;
+
+  bdev = file_to_device(file)->private;
+
+  while (ret < count) {
+    offset = file->ft->offset + ret;
+    size = SECTOR_SIZE - offset % SECTOR_SIZE;
+
+    if (size > count - ret) {
+      size = count - ret;
+    }
+
+    if ((op == BIO_READ || size < SECTOR_SIZE) && block_transfer(bdev, BIO_READ, offset / SECTOR_SIZE, sector, 1) < 0) {
+      break;
+    }
+
+    if (op == BIO_READ) {
+      memcpy(buf + ret, sector + offset % SECTOR_SIZE, size);
+    }
+    else {
+      memcpy(sector + offset % SECTOR_SIZE, buf + ret, size);
+
+      if (block_transfer(bdev, BIO_WRITE, offset / SECTOR_SIZE, sector, 1) < 0) {
+        break;
+      }
+    }
+
+    ret += size;
+  }
+
+  file->ft->offset += ret;
+
+  return ret;
+}
@@ -0,0 +1,126 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <kernel/device.h>
+#include <kernel/file.h>
+#include <kernel/list.h>
+#include <kernel/slab.h>
+#include <kernel/wait.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+
+/*
+  block_transfer queues at most BLOCK_TRANSFER_BIOS bios at once before it
+  dispatches them.
+*/
+#define BLOCK_TRANSFER_BIOS 8
+
+/*
+  enum bio_operation represents the direction of a block I/O.
+*/
+enum bio_operation {
+  BIO_READ,
+  BIO_WRITE
+};
+
+/*
+  struct bio represents a block I/O of "count" sectors beginning at the sector
+  "sector" to or from the buffer "data". "status" is 0 if the I/O succeeded and
+  -1 otherwise, and "done" is completed once it has finished. A bio is linked
+  in its request by "link".
+*/
+struct bio {
+  int op;
+  uint32_t sector;
+  size_t count;
+  char* data;
+  int status;
+  struct completion done;
+  struct list_link link;
+};
+
+/*
+  struct block_request represents a single transfer to or from a block device.
+  It covers the "count" sectors beginning at the sector "sector", and the bios
+  which were merged into it are linked in sector order in "bios_head". Queued
+  requests are linked in their device's queue by "link".
+*/
+struct block_request {
+  int op;
+  uint32_t sector;
+  size_t count;
+  struct list_link bios_head;
+  struct list_link link;
+};
+
+struct block_device;
+
+/*
+  struct block_operations represents the operations of a block device driver.
+  "transfer" performs a request and returns 0 on success and -1 on failure.
+  The calling process may sleep while it runs.
+*/
+struct block_operations {
+  int (*transfer)(struct block_device* bdev, struct block_request* req);
+};
+
+/*
+  struct block_stats represents the counters of a block device. "bios" counts
+  the submitted bios, "merges" counts the bios which were merged into a queued
+  request, and "dispatches" counts the requests which were sent to the driver.
+*/
+struct block_stats {
+  size_t bios;
+  size_t merges;
+  size_t dispatches;
+};
+
+/*
+  struct block_device represents a block device. Requests are queued in sector
+  order in "queue_head" and are never larger than "max_sectors". "next_sector"
+  is the sector after the last dispatched request, and "active" is set while a
+  process is dispatching the queue.
+*/
+struct block_device {
+  struct device dev;
+  struct block_operations* ops;
+  size_t max_sectors;
+  uint32_t next_sector;
+  bool active;
+  struct list_link queue_head;
+  struct block_stats stats;
+  void* private;
+};
+
+/*
+  "root_block_device" is the block device which holds the filesystem. It is the
+  first block device which is registered.
+*/
+extern struct block_device* root_block_device;
+
+extern struct kmem_cache block_request_cache;
+
+extern struct file_operations block_file_operations;
+
+int block_device_register(struct block_device* bdev);
+
+void bio_init(struct bio* bio, int op, uint32_t sector, char* data, size_t count);
+void submit_bio(struct block_device* bdev, struct bio* bio);
+int bio_wait(struct bio* bio);
+void bio_end(struct bio* bio, int status);
+
+bool block_merge_bio(struct block_device* bdev, struct bio* bio);
+int block_queue_bio(struct block_device* bdev, struct bio* bio);
+struct block_request* block_next_request(struct block_device* bdev);
+void block_dispatch(struct block_device* bdev);
+
+int block_transfer(struct block_device* bdev, int op, uint32_t sector, char* data, size_t count);
+
+int block_file_read(struct file_info_int* file, char* buf, size_t count);
+int block_file_write(struct file_info_int* file, const char* buf, size_t count);
+int block_file_transfer(struct file_info_int* file, char* buf, size_t count, int op);
+
+#endif
@@ -1,25 +1,155 @@
+/*
+  buffer.c handles the buffer cache.
+
+  The buffer cache holds filesystem blocks in memory. Buffers are keyed by
+  their block number and hashed into a fixed number of buckets. Every buffer is
+  also in an LRU list, and once the cache holds more than "buffer_cache_limit"
+  bytes, the least recently used buffers which have no users are evicted.
+
+  Buffers which are changed are marked dirty and are only written back to the
+  filesystem when they are evicted or synced. The flusher kernel process syncs
+  them periodically, or sooner when too much of the cache is dirty.
+*/
+
 #include <kernel/buffer.h>
-#include <drivers/pl180.h>
 #include <kernel/asm/file.h>
+#include <kernel/block.h>
 #include <kernel/memory.h>
+#include <kernel/processor.h>
+#include <kernel/schedule.h>
 
 struct list_link buffers_head = LIST_INIT(buffers_head);
+struct list_link buffer_heads[BUFFER_HASH_SIZE];
+
+struct kmem_cache buffer_info_cache = KMEM_CACHE_INIT(buffer_info_cache, "buffer_info", sizeof(struct buffer_info), 0, NULL);
+
+size_t buffer_cache_limit = BUFFER_CACHE_LIMIT;
+size_t buffer_count = 0;
+size_t buffer_dirty_count = 0;
+struct buffer_stats buffer_stats;
+
+/*
+  "buffer_wait_queue" is where processes sleep until a buffer which is being
+  read is unlocked.
+*/
+struct wait_queue buffer_wait_queue = WAIT_QUEUE_INIT(buffer_wait_queue);
+
+/*
+  "buffer_flusher_queue" is where the flusher sleeps until a sync is due, and
+  "buffer_flush_ticks" is the scheduler tick of its last sync.
+*/
+struct wait_queue buffer_flusher_queue = WAIT_QUEUE_INIT(buffer_flusher_queue);
+volatile uint32_t buffer_flush_ticks = 0;
+
+/*
+  buffer_init initializes the buffer cache's hash buckets.
+*/
+void buffer_init() {
+  for (size_t i = 0; i < BUFFER_HASH_SIZE; ++i) {
+    list_init(&buffer_heads[i]);
+  }
+}
 
 /*
-  buffer_get reads the filesystem for the block number "num" and returns buffer
-  information for it.
+  buffer_get returns the buffer information for the block number "num" and
+  takes a reference to it for the caller. If the block isn't cached, then it is
+  read from the filesystem. If another process is reading it, then the caller
+  sleeps until the read has finished. On failure NULL is returned. The
+  reference is released with buffer_put.
 */
 struct buffer_info* buffer_get(uint32_t num) {
   struct buffer_info* buffer;
-  struct list_link* curr;
+  uint32_t cpsr;
+  int status;
 
-  curr = buffers_head.next;
+  /*
+    Evicting may sleep, so it is done before the cache is searched and the
+    buffer is added without sleeping in between.
+  */
+  if (!buffer_find(num) && (buffer_count + 1) * BLOCK_SIZE > buffer_cache_limit) {
+    buffer_evict();
+  }
+
+  cpsr = save_interrupts();
+  buffer = buffer_find(num);
+
+  if (buffer) {
+    ++buffer_stats.hits;
+    ++buffer->ref;
+
+    list_remove(&buffers_head, &buffer->lru_link);
+    list_push(&buffers_head, &buffer->lru_link);
+  }
+  else {
+    ++buffer_stats.misses;
+    buffer = buffer_alloc(num);
+  }
+
+  if (!buffer) {
+    restore_interrupts(cpsr);
+    return NULL;
+  }
 
   /*
-    We first check if the buffer information is in the cache. If it is, then we
-    return it.
+    A buffer which isn't up to date is read by the process which finds it
+    unlocked, and the processes which wait on it see the result. Interrupts
+    stay disabled from the check until it is locked, so only one process can
+    start the read.
   */
-  while (curr != &buffers_head) {
+  while (buffer->status & BS_LOCKED) {
+    wait_queue_sleep(&buffer_wait_queue);
+    restore_interrupts(cpsr);
+    cpsr = save_interrupts();
+  }
+
+  if (buffer->status & BS_UPTODATE) {
+    restore_interrupts(cpsr);
+    return buffer;
+  }
+
+  buffer->status |= BS_LOCKED;
+  restore_interrupts(cpsr);
+
+  status = buffer_read(num, buffer->data);
+
+  cpsr = save_interrupts();
+
+  if (status == 0) {
+    buffer->status |= BS_UPTODATE;
+  }
+
+  buffer->status &= ~BS_LOCKED;
+  wait_queue_wake(&buffer_wait_queue);
+
+  if (!(buffer->status & BS_UPTODATE)) {
+    --buffer->ref;
+
+    if (!buffer->ref) {
+      buffer_free(buffer);
+    }
+
+    buffer = NULL;
+  }
+
+  restore_interrupts(cpsr);
+
+  return buffer;
+}
+
+/*
+  buffer_find returns the buffer information for the block number "num" if it
+  is in the cache. Otherwise it returns NULL. Unlike buffer_get, it doesn't
+  take a reference.
+*/
+struct buffer_info* buffer_find(uint32_t num) {
+  struct list_link* head;
+  struct list_link* curr;
+  struct buffer_info* buffer;
+
+  head = &buffer_heads[buffer_hash(num)];
+  curr = head->next;
+
+  while (curr != head) {
     buffer = list_data(curr, struct buffer_info, link);
 
     if (buffer->num == num) {
@@ -29,41 +159,342 @@ struct buffer_info* buffer_get(uint32_t num) {
     curr = curr->next;
   }
 
+  return NULL;
+}
+
+/*
+  buffer_read reads the block number "num" from the filesystem into "data". It
+  returns 0 on success and -1 on failure.
+*/
+int buffer_read(uint32_t num, char* data) {
+  return buffer_read_blocks(num, data, 1);
+}
+
+/*
+  buffer_read_blocks reads the "count" contiguous blocks beginning at the
+  block number "num" from the filesystem into "data" with one transfer. The
+  blocks are read directly and bypass the buffer cache. It returns 0 on success
+  and -1 on failure.
+*/
+int buffer_read_blocks(uint32_t num, char* data, size_t count) {
+  return block_transfer(root_block_device, BIO_READ, num * SECTORS_PER_BLOCK, data, count * SECTORS_PER_BLOCK);
+}
+
+/*
+  buffer_put releases a reference to the buffer information "buffer_info". The
+  buffer stays cached until it is evicted.
+*/
+void buffer_put(struct buffer_info* buffer_info) {
+  uint32_t cpsr;
+
+  if (!buffer_info) {
+    return;
+  }
+
+  cpsr = save_interrupts();
+
+  if (buffer_info->ref) {
+    --buffer_info->ref;
+  }
+
+  restore_interrupts(cpsr);
+}
+
+/*
+  buffer_dirty marks the buffer information "buffer_info" as changed, so that
+  it is written back to the filesystem before it is evicted.
+*/
+void buffer_dirty(struct buffer_info* buffer_info) {
+  if (!(buffer_info->status & BS_DIRTY)) {
+    ++buffer_dirty_count;
+
+    if (is_buffer_cache_dirty()) {
+      wait_queue_wake(&buffer_flusher_queue);
+    }
+  }
+
+  buffer_info->status |= BS_DIRTY;
+}
+
+/*
+  buffer_write writes the buffer information "buffer_info" to the filesystem
+  and marks it as clean. The calling process may sleep during the write.
+*/
+void buffer_write(struct buffer_info* buffer_info) {
+  struct bio bio;
+
+  buffer_write_begin(buffer_info, &bio);
+  block_dispatch(root_block_device);
+  buffer_write_end(buffer_info, &bio);
+}
+
+/*
+  buffer_write_begin submits the write of the buffer information "buffer_info"
+  with the bio "bio" and marks it as clean. The write must be ended with
+  buffer_write_end.
+*/
+void buffer_write_begin(struct buffer_info* buffer_info, struct bio* bio) {
+  uint32_t cpsr;
+
+  cpsr = save_interrupts();
+
   /*
-    If the buffer information isn't in the cache, then we allocate it.
+    The buffer is marked clean before it is written, so that a change made
+    while the write sleeps marks it dirty again. The reference keeps it from
+    being evicted in the meantime.
   */
-  buffer = memory_alloc(sizeof(struct buffer_info));
-  buffer->data = memory_alloc(BLOCK_SIZE);
+  if (buffer_info->status & BS_DIRTY) {
+    --buffer_dirty_count;
+  }
 
-  buffer->num = num;
+  buffer_info->status &= ~BS_DIRTY;
+  ++buffer_info->ref;
+  restore_interrupts(cpsr);
+
+  bio_init(bio, BIO_WRITE, buffer_info->num * SECTORS_PER_BLOCK, buffer_info->data, SECTORS_PER_BLOCK);
+  submit_bio(root_block_device, bio);
+}
+
+/*
+  buffer_write_end waits for the write of the buffer information "buffer_info"
+  with the bio "bio" to finish. If it failed, then the buffer is marked dirty
+  again and as having a write error.
+*/
+void buffer_write_end(struct buffer_info* buffer_info, struct bio* bio) {
+  const int status = bio_wait(bio);
+  uint32_t cpsr;
+
+  cpsr = save_interrupts();
+
+  if (status < 0) {
+    buffer_dirty(buffer_info);
+    buffer_info->status |= BS_WRITE_ERROR;
+  }
+  else {
+    buffer_info->status &= ~BS_WRITE_ERROR;
+    ++buffer_stats.writebacks;
+  }
+
+  --buffer_info->ref;
+  restore_interrupts(cpsr);
+}
+
+/*
+  buffer_sync writes every dirty buffer back to the filesystem. Up to
+  BUFFER_SYNC_BATCH buffers are submitted in block number order before they
+  are dispatched, so that adjacent buffers are merged into single transfers.
+  Interrupts are only disabled while a batch is found and submitted.
+*/
+void buffer_sync() {
+  struct buffer_info* buffers[BUFFER_SYNC_BATCH];
+  struct bio bios[BUFFER_SYNC_BATCH];
+  struct buffer_info* buffer;
+  uint32_t num = 0;
+  uint32_t cpsr;
+  size_t n;
+
+  do {
+    n = 0;
+    cpsr = save_interrupts();
+
+    while (n < BUFFER_SYNC_BATCH && (buffer = buffer_find_dirty(num))) {
+      buffer_write_begin(buffer, &bios[n]);
+      buffers[n++] = buffer;
+      num = buffer->num + 1;
+
+      if (!num) {
+        break;
+      }
+    }
+
+    restore_interrupts(cpsr);
+    block_dispatch(root_block_device);
+
+    for (size_t i = 0; i < n; ++i) {
+      buffer_write_end(buffers[i], &bios[i]);
+    }
+  } while (n == BUFFER_SYNC_BATCH && num);
+}
 
-  for (size_t i = 0; i < BLOCK_SIZE / MCI_BLOCK_SIZE; ++i) {
-    size_t offset = i * MCI_BLOCK_SIZE;
+/*
+  buffer_find_dirty returns the dirty buffer with the lowest block number which
+  is at least "num". If there is none, then NULL is returned.
+*/
+struct buffer_info* buffer_find_dirty(uint32_t num) {
+  struct list_link* curr;
+  struct buffer_info* buffer;
+  struct buffer_info* ret = NULL;
+
+  curr = buffers_head.next;
 
-    mci_read(BLOCK_SIZE * num + offset, buffer->data + offset);
+  while (curr != &buffers_head) {
+    buffer = list_data(curr, struct buffer_info, lru_link);
+
+    if (buffer->status & BS_DIRTY && buffer->num >= num && (!ret || buffer->num < ret->num)) {
+      ret = buffer;
+    }
+
+    curr = curr->next;
   }
 
-  list_push(&buffers_head, &buffer->link);
+  return ret;
+}
+
+/*
+  is_buffer_cache_dirty returns if more than BUFFER_DIRTY_RATIO percent of the
+  buffer cache limit is dirty.
+*/
+bool is_buffer_cache_dirty() {
+  return buffer_dirty_count * BLOCK_SIZE * 100 > buffer_cache_limit * BUFFER_DIRTY_RATIO;
+}
+
+/*
+  is_buffer_flush_due returns if the flusher should sync the buffer cache,
+  which is once BUFFER_FLUSH_INTERVAL scheduler ticks have passed since its last
+  sync or once the cache is too dirty.
+*/
+bool is_buffer_flush_due() {
+  return schedule_ticks - buffer_flush_ticks >= BUFFER_FLUSH_INTERVAL || is_buffer_cache_dirty();
+}
+
+/*
+  buffer_flush_tick wakes the flusher if its interval has passed. It is called
+  from the scheduler tick.
+*/
+void buffer_flush_tick() {
+  if (schedule_ticks - buffer_flush_ticks >= BUFFER_FLUSH_INTERVAL) {
+    wait_queue_wake(&buffer_flusher_queue);
+  }
+}
+
+/*
+  buffer_flusher is the body of the flusher kernel process. It sleeps until a
+  sync is due and then syncs the buffer cache. It is woken by the scheduler
+  tick every BUFFER_FLUSH_INTERVAL ticks, and by buffer_dirty once the cache is
+  too dirty.
+*/
+int buffer_flusher() {
+  uint32_t cpsr;
+
+  buffer_flush_ticks = schedule_ticks;
+
+  while (1) {
+    cpsr = save_interrupts();
+
+    while (!is_buffer_flush_due()) {
+      wait_queue_sleep(&buffer_flusher_queue);
+      restore_interrupts(cpsr);
+      cpsr = save_interrupts();
+    }
+
+    restore_interrupts(cpsr);
+
+    buffer_sync();
+    buffer_flush_ticks = schedule_ticks;
+  }
+
+  return 0;
+}
+
+/*
+  buffer_alloc allocates buffer information for the block number "num", adds
+  it to the cache with a reference for the caller, and returns it. The
+  buffer's data isn't read, and it isn't up to date until it is. It doesn't
+  sleep, so buffers are evicted by the caller beforehand.
+*/
+struct buffer_info* buffer_alloc(uint32_t num) {
+  struct buffer_info* buffer;
+
+  buffer = kmem_cache_alloc(&buffer_info_cache);
+
+  if (!buffer) {
+    return NULL;
+  }
+
+  buffer->data = memory_page_alloc(page_count(BLOCK_SIZE));
+
+  if (!buffer->data) {
+    kmem_cache_free(&buffer_info_cache, buffer);
+    return NULL;
+  }
+
+  buffer->num = num;
+  buffer->status = 0;
+  buffer->ref = 1;
+
+  list_push(&buffer_heads[buffer_hash(num)], &buffer->link);
+  list_push(&buffers_head, &buffer->lru_link);
+  ++buffer_count;
+
   return buffer;
 }
 
 /*
-  buffer_put writes the buffer information "buffer_info" to the filesystem and
-  frees it.
+  buffer_free removes the buffer information "buffer_info" from the cache and
+  frees it. It must not have any users or be dirty.
 */
-void buffer_put(struct buffer_info* buffer_info) {
-  buffer_write(buffer_info);
-  list_remove(&buffers_head, &buffer_info->link);
-  memory_free(buffer_info->data);
-  memory_free(buffer_info);
+void buffer_free(struct buffer_info* buffer_info) {
+  list_remove(&buffer_heads[buffer_hash(buffer_info->num)], &buffer_info->link);
+  list_remove(&buffers_head, &buffer_info->lru_link);
+  --buffer_count;
+
+  page_put(virt_to_page((uint32_t)buffer_info->data));
+  kmem_cache_free(&buffer_info_cache, buffer_info);
 }
+
 /*
-  buffer_write writes the buffer information "buffer_info" to the filesystem.
+  buffer_evict evicts the least recently used buffers without users until the
+  cache has room for another buffer. Dirty buffers are written back before
+  they are evicted. Dirty buffers whose last write failed are skipped and left
+  to the flusher to retry, so a failing block can't stall eviction. If every
+  buffer is in use, then the cache is allowed to grow past its limit.
 */
-void buffer_write(struct buffer_info* buffer_info) {
-  for (size_t i = 0; i < BLOCK_SIZE / MCI_BLOCK_SIZE; ++i) {
-    size_t offset = i * MCI_BLOCK_SIZE;
+void buffer_evict() {
+  struct list_link* curr;
+  struct list_link* prev;
+  struct buffer_info* buffer;
+  struct bio bio;
+  uint32_t cpsr;
+
+  /*
+    Interrupts are disabled while the list is scanned, so a buffer can't gain
+    a user between being checked and being freed. They are only enabled
+    around writes.
+  */
+  cpsr = save_interrupts();
+  curr = buffers_head.prev;
 
-    mci_write(BLOCK_SIZE * buffer_info->num + offset, buffer_info->data + offset);
+  while (curr != &buffers_head && (buffer_count + 1) * BLOCK_SIZE > buffer_cache_limit) {
+    prev = curr->prev;
+    buffer = list_data(curr, struct buffer_info, lru_link);
+
+    if (!buffer->ref && !(buffer->status & BS_DIRTY && buffer->status & BS_WRITE_ERROR)) {
+      /* The write may sleep and change the list, so it is scanned again. */
+      if (buffer->status & BS_DIRTY) {
+        buffer_write_begin(buffer, &bio);
+        restore_interrupts(cpsr);
+
+        block_dispatch(root_block_device);
+        buffer_write_end(buffer, &bio);
+
+        cpsr = save_interrupts();
+        curr = buffers_head.prev;
+        continue;
+      }
+
+      buffer_free(buffer);
+      ++buffer_stats.evictions;
+    }
+
+    curr = prev;
   }
+
+  restore_interrupts(cpsr);
+}
+
+/*
+  buffer_hash returns the hash bucket index of the block number "num".
+*/
+size_t buffer_hash(uint32_t num) {
+  return num % BUFFER_HASH_SIZE;
 }
@@ -1,23 +1,112 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <kernel/block.h>
 #include <kernel/list.h>
+#include <kernel/slab.h>
+#include <kernel/wait.h>
 
+#define BUFFER_HASH_SIZE 64
+#define BUFFER_CACHE_LIMIT 0x40000
+
+/*
+  The flusher writes dirty buffers back every BUFFER_FLUSH_INTERVAL scheduler
+  ticks, or sooner once more than BUFFER_DIRTY_RATIO percent of the cache
+  limit is dirty.
+*/
+#define BUFFER_FLUSH_INTERVAL 5000
+#define BUFFER_DIRTY_RATIO 50
+
+/*
+  buffer_sync submits up to BUFFER_SYNC_BATCH dirty buffers at once, so that
+  the block layer can merge adjacent ones.
+*/
+#define BUFFER_SYNC_BATCH 16
+
+#define SECTORS_PER_BLOCK (BLOCK_SIZE / SECTOR_SIZE)
+
+/*
+  enum buffer_status represents the status of a buffer. A buffer is up to date
+  once its data has been read, and it is locked while it is being read. A
+  write error is kept until the buffer is written back successfully.
+*/
+enum buffer_status {
+  BS_DIRTY = (1 << 0),
+  BS_UPTODATE = (1 << 1),
+  BS_LOCKED = (1 << 2),
+  BS_WRITE_ERROR = (1 << 3)
+};
+
+/*
+  struct buffer_info represents a cached filesystem block. "ref" is the number
+  of users of the buffer, and a buffer is only evicted when it has none. The
+  buffer is linked in its hash bucket by "link" and in the LRU list by
+  "lru_link".
+*/
 struct buffer_info {
   uint32_t num;
   int status;
+  unsigned int ref;
   char* data;
   struct list_link link;
+  struct list_link lru_link;
+};
+
+/*
+  struct buffer_stats represents the buffer cache counters. "hits" and
+  "misses" count the lookups in buffer_get, "evictions" counts the buffers
+  which were evicted to stay under the cache limit, and "writebacks" counts
+  the dirty buffers which were written to the filesystem.
+*/
+struct buffer_stats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t writebacks;
 };
 
 /*
-  "buffers_head" is the head node of the buffer information list.
+  "buffers_head" is the head node of the buffer LRU list. The most recently
+  used buffer is first.
 */
 extern struct list_link buffers_head;
+extern struct list_link buffer_heads[BUFFER_HASH_SIZE];
+
+extern struct kmem_cache buffer_info_cache;
+
+extern size_t buffer_cache_limit;
+extern size_t buffer_count;
+extern size_t buffer_dirty_count;
+extern struct buffer_stats buffer_stats;
+extern struct wait_queue buffer_wait_queue;
+extern struct wait_queue buffer_flusher_queue;
+extern volatile uint32_t buffer_flush_ticks;
+
+void buffer_init();
 
 struct buffer_info* buffer_get(uint32_t num);
+struct buffer_info* buffer_find(uint32_t num);
+int buffer_read(uint32_t num, char* data);
+int buffer_read_blocks(uint32_t num, char* data, size_t count);
 void buffer_put(struct buffer_info* buffer_info);
+void buffer_dirty(struct buffer_info* buffer_info);
 void buffer_write(struct buffer_info* buffer_info);
+void buffer_write_begin(struct buffer_info* buffer_info, struct bio* bio);
+void buffer_write_end(struct buffer_info* buffer_info, struct bio* bio);
+void buffer_sync();
+struct buffer_info* buffer_find_dirty(uint32_t num);
+bool is_buffer_cache_dirty();
+bool is_buffer_flush_due();
+void buffer_flush_tick();
+int buffer_flusher();
+
+struct buffer_info* buffer_alloc(uint32_t num);
+void buffer_free(struct buffer_info* buffer_info);
+void buffer_evict();
+
+size_t buffer_hash(uint32_t num);
 
 #endif
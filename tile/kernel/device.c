@@ -3,6 +3,7 @@
 struct device* character_device_table[DEVICE_TABLE_SIZE];
 struct device* block_device_table[DEVICE_TABLE_SIZE];
 struct list_link devices_head = LIST_INIT(devices_head);
+struct kmem_cache device_cache = KMEM_CACHE_INIT(device_cache, "device", sizeof(struct device), 0, NULL);
 
 /*
   devices_init exposes all currently registered devices under "/dev". Can only
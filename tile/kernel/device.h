@@ -3,6 +3,7 @@
 
 #include <kernel/list.h>
 #include <kernel/file.h>
+#include <kernel/slab.h>
 
 #define DEVICE_TABLE_SIZE 255
 #define DEVICE_NAME_SIZE FILE_NAME_SIZE
@@ -31,6 +32,7 @@ struct device {
 extern struct device* character_device_table[DEVICE_TABLE_SIZE];
 extern struct device* block_device_table[DEVICE_TABLE_SIZE];
 extern struct list_link devices_head;
+extern struct kmem_cache device_cache;
 
 void devices_init();
 
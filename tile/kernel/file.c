@@ -31,6 +31,7 @@
 #include <kernel/list.h>
 #include <kernel/memory.h>
 #include <kernel/page.h>
+#include <kernel/page_cache.h>
 #include <kernel/process.h>
 #include <lib/stdlib.h>
 #include <lib/string.h>
@@ -42,6 +43,8 @@ struct filesystem_info filesystem_info;
 
 struct list_link files_head = LIST_INIT(files_head);
 
+struct kmem_cache file_info_cache = KMEM_CACHE_INIT(file_info_cache, "file_info_int", sizeof(struct file_info_int), 0, NULL);
+
 struct file_operations regular_operations = {
   .read = regular_read,
   .write = regular_write
@@ -66,6 +69,7 @@ void filesystem_init() {
   */
   buffer_info = buffer_get(0);
   filesystem_info = *(struct filesystem_info*)buffer_info->data;
+  buffer_put(buffer_info);
 }
 
 /*
@@ -93,16 +97,10 @@ void filesystem_put() {
   */
   buffer = buffer_get(0);
   *(struct filesystem_info*)buffer->data = filesystem_info;
+  buffer_dirty(buffer);
+  buffer_put(buffer);
 
-  curr = buffers_head.next;
-
-  while (curr != &buffers_head) {
-    next = curr->next;
-    buffer = list_data(curr, struct buffer_info, link);
-
-    buffer_put(buffer);
-    curr = next;
-  }
+  buffer_sync();
 }
 
 /*
@@ -373,6 +371,7 @@ int file_mknod(const char* pathname, int mode, int dev) {
   buffer = buffer_get(addr.num);
   memcpy(buffer->data + addr.offset, &directory, sizeof(directory));
 
+  buffer_dirty(buffer);
   buffer_put(buffer);
   file_put(parent);
 
@@ -505,30 +504,18 @@ int file_chown(char* pathname, int owner, int group) {
 }
 
 /*
-  file_map maps the file specified by the file descriptor "fd" with the flags
-  "flags". On success it returns a pointer to the mapped area.
+  file_map maps the whole file specified by the file descriptor "fd" with the
+  flags "flags" as a shared region. On success it returns a pointer to the
+  mapped area.
 */
 void* file_map(int fd, int flags) {
-  struct memory_info* mem = current->mem;
   struct file_info_int* file = fd_to_file(fd);
-  struct page_region* region;
-  void* addr;
-
-  addr = find_unmapped_region(mem, file->ext.size);
-
-  if (!addr) {
-    return NULL;
-  }
 
-  region = create_file_page_region((uint32_t)addr, page_count(file->ext.size), flags, file);
-
-  if (!region) {
+  if (!file) {
     return NULL;
   }
 
-  insert_page_region(mem, region);
-
-  return addr;
+  return region_map(0, file->ext.size, flags, MAP_SHARED, fd, 0);
 }
 
 /*
@@ -604,6 +591,8 @@ int regular_write(struct file_info_int* file, const char* buf, size_t count) {
     addr = file_offset_to_addr(file, i * BLOCK_SIZE + file_tab->offset);
     buffer = buffer_get(addr.num);
     memcpy(buffer->data + addr.offset, buf + ret, BLOCK_SIZE);
+    buffer_dirty(buffer);
+    page_cache_update(file, i * BLOCK_SIZE + file_tab->offset, buf + ret, BLOCK_SIZE);
     buffer_put(buffer);
     ret += BLOCK_SIZE;
   }
@@ -614,6 +603,8 @@ int regular_write(struct file_info_int* file, const char* buf, size_t count) {
   addr = file_offset_to_addr(file, ret + file_tab->offset);
   buffer = buffer_get(addr.num);
   memcpy(buffer->data + addr.offset, buf + ret, count % BLOCK_SIZE);
+  buffer_dirty(buffer);
+  page_cache_update(file, ret + file_tab->offset, buf + ret, count % BLOCK_SIZE);
   buffer_put(buffer);
   ret += count % BLOCK_SIZE;
 
@@ -644,6 +635,67 @@ uint16_t get_minor(int dev) {
   return dev & 0xffff;
 }
 
+/*
+  file_sync writes all cached filesystem structures, shared writable file
+  mappings, and dirty buffers back to the filesystem.
+*/
+int file_sync() {
+  struct list_link* curr;
+  struct buffer_info* buffer;
+
+  curr = processes_head.next;
+
+  while (curr != &processes_head) {
+    sync_page_regions(list_data(curr, struct process_info, link)->mem, NULL);
+    curr = curr->next;
+  }
+
+  curr = files_head.next;
+
+  while (curr != &files_head) {
+    file_write_info(list_data(curr, struct file_info_int, link));
+    curr = curr->next;
+  }
+
+  buffer = buffer_get(0);
+
+  if (buffer) {
+    *(struct filesystem_info*)buffer->data = filesystem_info;
+    buffer_dirty(buffer);
+    buffer_put(buffer);
+  }
+
+  buffer_sync();
+
+  return 0;
+}
+
+/*
+  file_fsync writes the file specified by the file descriptor "fd" back to the
+  filesystem, along with the calling process's shared writable mappings of it.
+  The buffer cache doesn't track which file a buffer belongs to, so every
+  dirty buffer is written.
+*/
+int file_fsync(int fd) {
+  struct file_info_int* file;
+
+  if (fd < 0 || fd >= FILE_TABLE_SIZE) {
+    return -1;
+  }
+
+  file = fd_to_file(fd);
+
+  if (!file) {
+    return -1;
+  }
+
+  sync_page_regions(current->mem, file);
+  file_write_info(file);
+  buffer_sync();
+
+  return 0;
+}
+
 /*
   file_chdir changes the current directory to the directory specified by
   "pathname". It returns 0 on success, and -1 on failure.
@@ -772,6 +824,7 @@ void file_push_blocks(struct file_info_int* file, size_t count) {
       if (prev_index != curr_index) {
         alloc_buffer = block_alloc();
         ((uint32_t*)(get_buffer->data))[curr_index] = alloc_buffer->num;
+        buffer_dirty(get_buffer);
         buffer_put(alloc_buffer);
       }
 
@@ -791,6 +844,9 @@ void file_pop_blocks(struct file_info_int* file, size_t count) {
   uint32_t block_num;
   struct buffer_info* get_buffers[2];
 
+  /* The cached pages of the popped blocks no longer belong to the file. */
+  page_cache_invalidate(file, BLOCK_SIZE * (curr_blocks - count));
+
   for (size_t i = 0; i < count; ++i) {
     offset = BLOCK_SIZE * (curr_blocks - (i + 1));
     block_info = file_offset_to_block(offset);
@@ -828,7 +884,7 @@ void file_pop_blocks(struct file_info_int* file, size_t count) {
     if (file_offset_to_block(offset - BLOCK_SIZE).index != block_info.index || !block_info.index) {
       get_buffers[0] = buffer_get(file->ext.blocks[block_info.index]);
       block_free(get_buffers[0]);
-      buffer_put(get_buffers[1]);
+      buffer_put(get_buffers[0]);
     }
   }
 }
@@ -1076,6 +1132,7 @@ struct file_info_int* file_get(uint32_t file_info_num) {
     file = list_data(curr, struct file_info_int, link);
 
     if (file->ext.num == file_info_num) {
+      buffer_put(buffer);
       ++file->ref;
       return file;
     }
@@ -1083,8 +1140,15 @@ struct file_info_int* file_get(uint32_t file_info_num) {
     curr = curr->next;
   }
 
-  file = memory_alloc(sizeof(struct file_info_int));
+  file = kmem_cache_alloc(&file_info_cache);
+
+  if (!file) {
+    buffer_put(buffer);
+    return NULL;
+  }
+
   file->ext = *(struct file_info_ext*)(buffer->data + addr.offset);
+  buffer_put(buffer);
   file->ref = 1;
   list_push(&files_head, &file->link);
 
@@ -1097,22 +1161,35 @@ struct file_info_int* file_get(uint32_t file_info_num) {
   information "file_info" to the SD card.
 */
 void file_put(struct file_info_int* file_info) {
-  struct filesystem_addr addr;
-  struct buffer_info* buffer;
-
   if (!file_info) {
     return;
   }
 
   if (--file_info->ref == 0) {
-    addr = file_to_addr(file_info->ext.num);
-    buffer = buffer_get(addr.num);
-
-    memcpy(buffer->data + addr.offset, &file_info->ext, sizeof(struct file_info_ext));
-    buffer_put(buffer);
+    file_write_info(file_info);
     list_remove(&files_head, &file_info->link);
-    memory_free(file_info);
+    kmem_cache_free(&file_info_cache, file_info);
+  }
+}
+
+/*
+  file_write_info writes the external file information from the internal file
+  information "file_info" to its buffer.
+*/
+void file_write_info(const struct file_info_int* file_info) {
+  struct filesystem_addr addr;
+  struct buffer_info* buffer;
+
+  addr = file_to_addr(file_info->ext.num);
+  buffer = buffer_get(addr.num);
+
+  if (!buffer) {
+    return;
   }
+
+  memcpy(buffer->data + addr.offset, &file_info->ext, sizeof(struct file_info_ext));
+  buffer_dirty(buffer);
+  buffer_put(buffer);
 }
 
 /*
@@ -1164,6 +1241,10 @@ struct file_info_int* file_alloc() {
   num = filesystem_info.free_file_infos[filesystem_info.free_file_infos_size];
   ret = file_get(num);
   ret->ext.type = 1;
+
+  /* A reused file information number mustn't find the old file's pages. */
+  page_cache_invalidate(ret, 0);
+
   return ret;
 }
 
@@ -1173,6 +1254,8 @@ struct file_info_int* file_alloc() {
   list.
 */
 void file_free(const struct file_info_int* file_info) {
+  page_cache_invalidate(file_info, 0);
+
   if (filesystem_info.free_file_infos_size == FILESYSTEM_INFO_CACHE_SIZE) {
     return;
   }
@@ -1202,12 +1285,14 @@ struct buffer_info* block_alloc() {
   }
 
   memset(ret->data, 0, BLOCK_SIZE);
+  buffer_dirty(ret);
   return ret;
 }
 
 /*
   block_free frees the block specified by "buffer_info". It tries to push the
-  block to the free block list.
+  block to the free block list. The caller keeps its reference to
+  "buffer_info".
 */
 void block_free(struct buffer_info* buffer_info) {
   size_t free_blocks_size = filesystem_info.next_free_block + 1;
@@ -1221,7 +1306,7 @@ void block_free(struct buffer_info* buffer_info) {
     memcpy((uint32_t*)buffer_info->data + 1, filesystem_info.free_blocks, free_blocks_size * sizeof(uint32_t));
     filesystem_info.next_free_block = 0;
     *filesystem_info.free_blocks = buffer_info->num;
-    buffer_put(buffer_info);
+    buffer_dirty(buffer_info);
   }
   else {
     filesystem_info.free_blocks[free_blocks_size] = buffer_info->num;
@@ -4,6 +4,7 @@
 #include <kernel/asm/file.h>
 #include <kernel/list.h>
 #include <kernel/process.h>
+#include <kernel/slab.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -227,6 +228,8 @@ extern struct filesystem_info filesystem_info;
 */
 extern struct list_link files_head;
 
+extern struct kmem_cache file_info_cache;
+
 extern struct file_operations regular_operations;
 
 void filesystem_init();
@@ -250,6 +253,9 @@ int file_chown(char* pathname, int owner, int group);
 
 void* file_map(int fd, int flags);
 
+int file_sync();
+int file_fsync(int fd);
+
 int file_chdir(const char* pathname);
 
 int regular_read(struct file_info_int*, char* buf, size_t count);
@@ -276,6 +282,7 @@ char* normalize_pathname(char* pathname);
 
 struct file_info_int* file_get(uint32_t file_info_num);
 void file_put(struct file_info_int* file_info);
+void file_write_info(const struct file_info_int* file_info);
 
 struct file_info_int* file_alloc();
 void file_free(const struct file_info_int* file_info);
@@ -1,22 +1,26 @@
 #include <kernel/interrupts.h>
 #include <drivers/gic_400.h>
 #include <drivers/pl011.h>
+#include <drivers/pl180.h>
 #include <drivers/sp804.h>
-#include <kernel/buffer.h>
 #include <kernel/file.h>
 #include <kernel/memory.h>
+#include <kernel/page_cache.h>
 #include <kernel/process.h>
 #include <kernel/schedule.h>
 #include <kernel/syscall.h>
+#include <lib/string.h>
 
 /*
-  handle_fault handles a fault on address "addr". This fault can either be
-  caused by a data abort or a prefetch abort. If the faulting address is
-  mapped, then the containing page is demand paged in.
+  handle_fault handles a fault on address "addr" with the fault flags "fault".
+  This fault can either be caused by a data abort or a prefetch abort. If the
+  faulting address is mapped, then the containing page is demand paged in, or
+  copied on write if the fault is a write permission fault.
 */
-int handle_fault(uint32_t addr) {
+int handle_fault(uint32_t addr, int fault) {
   struct memory_info* mem;
   struct page_region* region;
+  size_t index;
   int ret;
 
   if (addr == 0) {
@@ -26,11 +30,39 @@ int handle_fault(uint32_t addr) {
   mem = current->mem;
   region = find_page_region(mem, addr);
 
+  /* An unmapped address may be just below a stack which can grow. */
   if (!region) {
+    region = expand_stack(mem, addr);
+  }
+
+  if (!region) {
+    return -1;
+  }
+
+  /* Regions without access permissions are never paged in. */
+  if (!(region->flags & PAGE_RWX)) {
+    return -1;
+  }
+
+  /*
+    The only fault which is handled on a page which is already present is a
+    write to a page which is shared copy-on-write. Any other fault on it, such
+    as executing an execute-never page, is an access the region doesn't allow.
+  */
+  index = page_index(addr - region->begin);
+
+  if (region->pages && region->pages[index]) {
+    if (fault & FAULT_WRITE && fault & FAULT_PERMISSION && region->flags & PAGE_WRITE) {
+      return handle_cow_fault(addr, region);
+    }
+
     return -1;
   }
 
   switch (region->type) {
+    case PR_ANON:
+      ret = handle_anon_fault(addr, region);
+      break;
     case PR_FILE:
       ret = handle_file_fault(addr, region);
       break;
@@ -44,71 +76,327 @@ int handle_fault(uint32_t addr) {
 
 /*
   handle_anon_fault handles a fault on address "addr" which exists in the page
-  region "region" which is anonymous.
+  region "region" which is anonymous. The page is demand allocated and zeroed.
+  If the page region is large enough, and the naturally aligned section or
+  large page around it is inside the page region and has no pages yet, then
+  the whole block is allocated and mapped with one descriptor instead.
 */
 int handle_anon_fault(uint32_t addr, struct page_region* region) {
   struct memory_info* mem;
+
+  mem = current->mem;
+
+  /* Page regions without page information are fixed mappings. */
+  if (!region->pages) {
+    return -1;
+  }
+
+  /* A section replaces the whole pmd, so it must be empty. */
+  if (is_anon_block_allowed(region, PMD_SIZE) && !*addr_to_pmd(mem->pgd, addr) && is_page_region_block_empty(region, ALIGN_DOWN(addr, PMD_SIZE), PMD_SIZE)) {
+    if (!map_anon_block(region, ALIGN_DOWN(addr, PMD_SIZE), PMD_SIZE)) {
+      return 0;
+    }
+  }
+
+  if (is_anon_block_allowed(region, LARGE_PAGE_SIZE) && is_page_region_block_empty(region, ALIGN_DOWN(addr, LARGE_PAGE_SIZE), LARGE_PAGE_SIZE)) {
+    if (!map_anon_block(region, ALIGN_DOWN(addr, LARGE_PAGE_SIZE), LARGE_PAGE_SIZE)) {
+      return 0;
+    }
+  }
+
+  return map_anon_block(region, ALIGN_DOWN(addr, PAGE_SIZE), PAGE_SIZE);
+}
+
+/*
+  is_anon_block_allowed returns if faults in the anonymous page region "region"
+  may be served with whole blocks of "size" bytes. The page region must span
+  at least ANON_BLOCK_MIN_COUNT of them and mustn't be a stack.
+*/
+bool is_anon_block_allowed(const struct page_region* region, uint32_t size) {
+  if (region->flags & PAGE_GROWSDOWN) {
+    return false;
+  }
+
+  return page_region_size(region) / size >= ANON_BLOCK_MIN_COUNT;
+}
+
+/*
+  map_anon_block allocates a zeroed naturally aligned block of "size" bytes and
+  maps it at the virtual address "v_addr" in the anonymous page region
+  "region". It returns 0 on success.
+*/
+int map_anon_block(struct page_region* region, uint32_t v_addr, uint32_t size) {
+  struct memory_info* mem;
+  const size_t count = page_count(size);
   size_t index;
   struct phys_page* page;
   uint64_t page_addr;
-  void* retval;
 
   mem = current->mem;
-
-  index = (addr - region->begin) >> PAGE_SHIFT;
-  page = pages_alloc(1, ZONE_HIGHMEM);
+  index = page_index(v_addr - region->begin);
+  page = pages_alloc(count, ZONE_HIGHMEM);
 
   if (!page) {
     return -1;
   }
 
-  page_addr = page_to_addr(page);
+  page_addr = page_to_phys(page);
 
-  retval = create_mapping(mem, ALIGN_DOWN(addr, PAGE_SIZE), page_addr, PAGE_SIZE, region->flags);
+  /*
+    Highmem isn't mapped by the kernel, so the block is zeroed through its new
+    mapping before it gets the page region's protection.
+  */
+  if (!map_block(mem, v_addr, page_addr, size, region->flags | PAGE_WRITE)) {
+    page_put(page);
+    return -1;
+  }
 
-  if (!retval) {
+  memset((void*)v_addr, 0, size);
+
+  if (!(region->flags & PAGE_WRITE)) {
+    map_block(mem, v_addr, page_addr, size, region->flags);
+    flush_page(mem, v_addr);
+  }
+
+  /* The page region owns each page's first reference. */
+  pages_split(page, count);
+
+  for (size_t i = 0; i < count; ++i) {
+    region->pages[index + i] = page + i;
+  }
+
+  mem->faults += count;
+
+  return 0;
+}
+
+/*
+  is_page_region_block_empty returns if the block of "size" bytes at the
+  virtual address "v_addr" is inside the page region "region" and none of its
+  pages are present.
+*/
+bool is_page_region_block_empty(const struct page_region* region, uint32_t v_addr, uint32_t size) {
+  size_t index;
+
+  if (v_addr < region->begin || v_addr + size > page_region_end(region)) {
+    return false;
+  }
+
+  index = page_index(v_addr - region->begin);
+
+  for (size_t i = 0; i < page_count(size); ++i) {
+    if (region->pages[index + i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+  handle_cow_fault handles a write fault on address "addr" which exists in the
+  page region "region" and whose page is shared copy-on-write. If the page has
+  no other references, then it is made writable. Otherwise it is copied into
+  a lowmem page, which the kernel can address through its linear mapping.
+*/
+int handle_cow_fault(uint32_t addr, struct page_region* region) {
+  struct memory_info* mem;
+  const uint32_t v_addr = ALIGN_DOWN(addr, PAGE_SIZE);
+  const size_t index = page_index(addr - region->begin);
+  struct phys_page* page;
+  struct phys_page* copy;
+
+  mem = current->mem;
+  page = region->pages[index];
+
+  if (page->ref == 1) {
+    if (!map_page(mem, v_addr, page_to_phys(page), region->flags)) {
+      return -1;
+    }
+
+    flush_page(mem, v_addr);
+    return 0;
+  }
+
+  copy = pages_alloc(1, ZONE_LOWMEM);
+
+  if (!copy) {
     return -1;
   }
 
+  memcpy((void*)page_to_virt(copy), (void*)v_addr, PAGE_SIZE);
+
+  if (!map_page(mem, v_addr, page_to_phys(copy), region->flags)) {
+    page_put(copy);
+    return -1;
+  }
+
+  flush_page(mem, v_addr);
+  region->pages[index] = copy;
+  page_put(page);
+
   return 0;
 }
 
 /*
   handle_file_fault handles a fault on address "addr" which exists in the page
-  region "region" which is file-backed.
+  region "region" which is file-backed. The cached pages around the faulting
+  page are mapped along with it.
 */
 int handle_file_fault(uint32_t addr, struct page_region* region) {
-  struct memory_info* mem;
   struct file_info_int* file;
   uint32_t offset;
-  struct filesystem_addr fs_addr;
-  struct buffer_info* buffer;
-  uint64_t phys_addr;
-  void* retval;
+  struct phys_page* page;
+  size_t index;
 
-  mem = current->mem;
   file = region->file;
 
   if (!file) {
     return -1;
   }
 
+  index = (addr - region->begin) >> PAGE_SHIFT;
   offset = region->file_offset + (addr - region->begin);
-  fs_addr = file_offset_to_addr(file, offset);
 
-  buffer = buffer_get(fs_addr.num);
-  phys_addr = virt_to_phys((uint32_t)buffer->data);
+  /* There is nothing to map past the end of the file. */
+  if (offset >= ALIGN(file->ext.size, PAGE_SIZE)) {
+    return -1;
+  }
+
+  handle_fault_around(region, index);
+
+  /* If reading ahead failed, then the faulting page is read on its own. */
+  if (!region->pages[index]) {
+    page = page_cache_get(file, offset);
+
+    if (!page || map_file_page(region, index, page) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+  handle_fault_around maps the pages around the page index "index" in the
+  file-backed page region "region" which are in the page cache. The page at
+  "index" and the ones which follow it are read ahead first, so that a
+  sequential access of the page region faults once every FAULT_AROUND_PAGES
+  pages. Blocks of pages which are physically contiguous are then remapped
+  with large pages.
+*/
+void handle_fault_around(struct page_region* region, size_t index) {
+  struct file_info_int* file = region->file;
+  size_t begin;
+  size_t end;
+  struct phys_page* page;
+
+  begin = ALIGN_DOWN(index, FAULT_AROUND_PAGES);
+  end = begin + FAULT_AROUND_PAGES;
+
+  if (end > region->count) {
+    end = region->count;
+  }
+
+  page_cache_read_ahead(file, region->file_offset + page_addr(index), end - index);
+
+  for (size_t i = begin; i < end; ++i) {
+    if (region->pages[i]) {
+      continue;
+    }
+
+    page = page_cache_find(file, region->file_offset + page_addr(i));
+
+    if (page) {
+      map_file_page(region, i, page);
+    }
+  }
+
+  for (size_t i = begin; i + PAGES_PER_LARGE_PAGE <= end; ++i) {
+    if (IS_ALIGNED(region->begin + page_addr(i), LARGE_PAGE_SIZE)) {
+      map_file_large_page(region, i);
+    }
+  }
+}
+
+/*
+  map_file_large_page remaps the LARGE_PAGE_SIZE block of pages at the page
+  index "index" in the file-backed page region "region" with a large page. The
+  pages must be one naturally aligned block of physical pages. It returns 0 on
+  success.
+*/
+int map_file_large_page(struct page_region* region, size_t index) {
+  struct memory_info* mem;
+  const uint32_t v_addr = region->begin + page_addr(index);
+  struct phys_page* page = region->pages[index];
+  int flags = region->flags;
+  struct tlb_gather tlb;
 
-  if (!phys_addr) {
+  mem = current->mem;
+
+  if (!page || !IS_ALIGNED(page_to_phys(page), LARGE_PAGE_SIZE)) {
+    return -1;
+  }
+
+  for (size_t i = 1; i < PAGES_PER_LARGE_PAGE; ++i) {
+    if (region->pages[index + i] != page + i) {
+      return -1;
+    }
+  }
+
+  if (region->flags & PAGE_PRIVATE) {
+    flags &= ~PAGE_WRITE;
+  }
+
+  if (!map_large_page(mem, v_addr, page_to_phys(page), flags)) {
     return -1;
   }
 
-  retval = create_mapping(mem, ALIGN_DOWN(addr, PAGE_SIZE), phys_addr, PAGE_SIZE, region->flags);
+  tlb_gather_init(&tlb, mem);
+  tlb_gather_range(&tlb, v_addr, LARGE_PAGE_SIZE);
+  tlb_gather_finish(&tlb);
+
+  return 0;
+}
+
+/*
+  map_file_page maps the page cache's page "page" at the page index "index" in
+  the file-backed page region "region". The reference to "page" is passed to
+  the page region.
+*/
+int map_file_page(struct page_region* region, size_t index, struct phys_page* page) {
+  struct memory_info* mem;
+  const uint32_t v_addr = region->begin + page_addr(index);
+  void* retval;
+
+  mem = current->mem;
+
+  /*
+    The page cache's page is mapped directly, so every process which maps it
+    shares it. Private pages are mapped read-only so that writes to them are
+    copied.
+  */
+  if (region->flags & PAGE_PRIVATE) {
+    retval = map_page(mem, v_addr, page_to_phys(page), region->flags & ~PAGE_WRITE);
+  }
+  else {
+    retval = map_page(mem, v_addr, page_to_phys(page), region->flags);
+  }
 
   if (!retval) {
+    page_put(page);
     return -1;
   }
 
+  /* The page region keeps the reference which was taken for it. */
+  if (!region->pages[index]) {
+    region->pages[index] = page;
+    ++mem->faults;
+  }
+  else {
+    page_put(page);
+  }
+
   return 0;
 }
 
@@ -134,13 +422,32 @@ void do_supervisor_call() {
   current->reg.r0 = ret;
 }
 
+/*
+  fsr_to_fault returns the fault flags of the fault status register value
+  "fsr".
+*/
+int fsr_to_fault(uint32_t fsr) {
+  int ret = 0;
+
+  if (fsr & FSR_WNR) {
+    ret |= FAULT_WRITE;
+  }
+
+  if (FSR_STATUS(fsr) == FSR_PERMISSION_SECTION || FSR_STATUS(fsr) == FSR_PERMISSION_PAGE) {
+    ret |= FAULT_PERMISSION;
+  }
+
+  return ret;
+}
+
 /*
   do_prefetch_abort handles the prefetch abort exception.
 */
 void do_prefetch_abort() {
   uint32_t ifar = get_ifar();
 
-  if (handle_fault(ifar) < 0) {
+  /* Instruction fetches are never writes. */
+  if (handle_fault(ifar, fsr_to_fault(get_ifsr()) & ~FAULT_WRITE) < 0) {
     panic("");
   }
 }
@@ -152,7 +459,7 @@ void do_prefetch_abort() {
 void do_data_abort() {
   uint32_t dfar = get_dfar();
 
-  if (handle_fault(dfar) < 0) {
+  if (handle_fault(dfar, fsr_to_fault(get_dfsr())) < 0) {
     panic("");
   }
 }
@@ -173,6 +480,9 @@ void do_irq() {
     case UART0INTR:
       do_uart_irq(&uart);
       break;
+    case MCI_INTR_0:
+      do_mci_irq();
+      break;
     default:
       break;
   }
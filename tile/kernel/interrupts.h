@@ -1,6 +1,8 @@
 #ifndef INTERRUPTS_H
 #define INTERRUPTS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <kernel/page.h>
 #include <kernel/processor.h>
@@ -45,9 +47,52 @@
 // PCI-Express interrupts.
 #define PCIE_GPEN 49
 
-int handle_fault(uint32_t addr);
+/*
+  A fault on a file page also maps the cached pages around it which are in the
+  same naturally aligned window of FAULT_AROUND_PAGES pages, after reading
+  ahead the ones which follow it.
+*/
+#define FAULT_AROUND_PAGES 16
+
+/*
+  A fault in an anonymous page region is only served with a whole section or
+  large page if the page region spans at least ANON_BLOCK_MIN_COUNT of them,
+  so that small regions only pay for the pages which are touched. Stacks are
+  always faulted in a page at a time.
+*/
+#define ANON_BLOCK_MIN_COUNT 4
+
+/*
+  The fault status bits of the short-descriptor DFSR and IFSR. Permission
+  faults have the status FSR_PERMISSION_SECTION or FSR_PERMISSION_PAGE, and
+  FSR_WNR is set in the DFSR for a fault caused by a write.
+*/
+#define FSR_STATUS(fsr) (((fsr) & 0xf) | (((fsr) >> 6) & 0x10))
+#define FSR_PERMISSION_SECTION 0xd
+#define FSR_PERMISSION_PAGE 0xf
+#define FSR_WNR (1 << 11)
+
+/*
+  enum fault_flags represents the cause of a fault. FAULT_WRITE is set for a
+  write access, and FAULT_PERMISSION for an access which the present mapping
+  doesn't permit, rather than an access to an unmapped page.
+*/
+enum fault_flags {
+  FAULT_WRITE = (1 << 0),
+  FAULT_PERMISSION = (1 << 1)
+};
+
+int handle_fault(uint32_t addr, int fault);
+int fsr_to_fault(uint32_t fsr);
 int handle_anon_fault(uint32_t addr, struct page_region* region);
+int map_anon_block(struct page_region* region, uint32_t v_addr, uint32_t size);
+bool is_anon_block_allowed(const struct page_region* region, uint32_t size);
+bool is_page_region_block_empty(const struct page_region* region, uint32_t v_addr, uint32_t size);
+int handle_cow_fault(uint32_t addr, struct page_region* region);
 int handle_file_fault(uint32_t addr, struct page_region* region);
+void handle_fault_around(struct page_region* region, size_t index);
+int map_file_page(struct page_region* region, size_t index, struct phys_page* page);
+int map_file_large_page(struct page_region* region, size_t index);
 
 void do_reset();
 void do_undefined_instruction();
@@ -59,6 +104,8 @@ void do_fiq();
 
 extern uint32_t get_dfar();
 extern uint32_t get_ifar();
+extern uint32_t get_dfsr();
+extern uint32_t get_ifsr();
 extern void ret_from_interrupt(struct processor_registers* registers);
 extern void ret_from_interrupt_user();
 
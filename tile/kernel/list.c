@@ -46,3 +46,10 @@ int list_remove(struct list_link* head, struct list_link* link) {
 
   return 0;
 }
+
+/*
+  is_list_empty returns if the list with head "head" is empty.
+*/
+bool is_list_empty(const struct list_link* head) {
+  return head->next == head;
+}
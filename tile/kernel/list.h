@@ -1,6 +1,7 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -26,5 +27,6 @@ void list_init(struct list_link* head);
 void list_push(struct list_link* head, struct list_link* link);
 struct list_link* list_pop(struct list_link* head);
 int list_remove(struct list_link* head, struct list_link* link);
+bool is_list_empty(const struct list_link* head);
 
 #endif
@@ -11,6 +11,8 @@
 #include <kernel/log.h>
 #include <kernel/memory.h>
 #include <kernel/page.h>
+#include <kernel/page_cache.h>
+#include <kernel/processor.h>
 #include <kernel/process.h>
 #include <kernel/schedule.h>
 
@@ -25,6 +27,18 @@ int user_init() {
 }
 
 int kernel_init() {
+  bool more;
+
+  /*
+    The page information which wasn't initialized at boot is initialized in
+    the background, one maximum order block at a time.
+  */
+  do {
+    disable_interrupts();
+    more = memory_deferred_init();
+    enable_interrupts();
+  } while (more);
+
   while(1);
 }
 
@@ -39,6 +53,11 @@ void init_processes() {
     NULL
   };
 
+  struct function_info flusher = {
+    &buffer_flusher,
+    NULL
+  };
+
   /* Open /dev/console for standard streams. */
   int fd = file_open("/dev/console", O_RDWR);
 
@@ -47,6 +66,7 @@ void init_processes() {
 
   process_clone(PT_USER, &user);
   process_clone(PT_KERNEL, &kernel);
+  process_clone(PT_KERNEL, &flusher);
 }
 
 /*
@@ -66,7 +86,9 @@ void start_kernel() {
   gic_init();
   dual_timer_init();
 
+  buffer_init();
   filesystem_init();
+  page_cache_init();
   devices_init();
 
   log_printf("%s", tile_banner);
@@ -9,17 +9,39 @@
   deals with memory groups which are abstractions of memory. It's heavily
   inspired by Linux's boot time memory management and memblock allocator.
 
-  The primary memory allocator is a first-fit allocator. It uses pages for
+  The primary memory allocator is a binary buddy allocator. It uses pages for
   backing memory. These pages serve as the foundation for further, more
-  granular allocations to be made on top of.
-
-  Both memory allocators deal with memory blocks which represent contiguous
-  free or reserved memory. A memory block is defined by its beginning and its
-  size in bytes. Memory blocks are stored in a doubly linked which is sorted by
-  the bounds of its entries.
+  granular allocations to be made on top of. Each page group keeps a free list
+  for every block order, where a block of order "n" is 2^n naturally aligned
+  pages. An allocation splits the smallest free block which can satisfy it, and
+  a free merges a block with its buddy for as long as its buddy is also free.
+
+  The information of every physical page is kept in a single flat array which
+  is indexed by page frame number, so translating between a page's information
+  and its address is a constant time operation. Each page group's pages are a
+  slice of this array. Page information is a single word, and the free lists
+  are linked through a separate array "free_links" with one link for every
+  pair of pages. Buddies are merged whenever both are free, so at most one free
+  block begins in each pair and they can share a link.
+
+  Every allocated block of pages is reference counted from its first page, so
+  that a block can be shared and is only freed when its last reference is
+  dropped.
+
+  Allocations smaller than a page are served from block size classes. Every
+  class is a power of two bytes and owns block pages which are split into
+  equally sized slots, with a bitmap of used slots at the beginning of each
+  block page. A freed block finds its class through its page's information, so
+  blocks carry no header of their own.
+
+  The secondary memory allocator deals with memory blocks which represent
+  contiguous free or reserved memory. A memory block is defined by its
+  beginning and its size in bytes. Memory blocks are stored in an array which
+  is sorted by the bounds of its entries.
 */
 
 #include <kernel/memory.h>
+#include <kernel/page_cache.h>
 #include <kernel/process.h>
 #include <lib/string.h>
 
@@ -31,10 +53,12 @@ static struct initmem_group initmem_reserved_group;
 
 struct initmem_info initmem_info;
 
+struct phys_page* mem_map;
+struct list_link* free_links;
 struct page_group* page_groups;
 struct list_link page_groups_head = LIST_INIT(page_groups_head);
 
-struct list_link alloc_pages_head = LIST_INIT(alloc_pages_head);
+struct block_class block_classes[BLOCK_CLASSES];
 
 uint32_t high_memory;
 
@@ -101,44 +125,75 @@ void update_memory_map() {
 }
 
 /*
-  memory_alloc_init initializes the primary memory allocator.
+  memory_alloc_init initializes the primary memory allocator. Only the first
+  MEMORY_EARLY_INIT_SIZE bytes of each page group have their page information
+  initialized. The rest is initialized on demand or by memory_deferred_init.
 */
 void memory_alloc_init() {
   struct initmem_block* block;
   struct page_group* group;
   struct list_link* curr;
+  uint64_t begin;
+  uint64_t end;
+
+  mem_map = initmem_alloc(page_count(PHYS_SIZE) * sizeof(struct phys_page));
+  free_links = initmem_alloc(page_count(PHYS_SIZE) / 2 * sizeof(struct list_link));
 
   for (size_t i = 0; i < initmem_info.memory->size; ++i) {
     block = &initmem_info.memory->blocks[i];
+
+    /* Page groups hold whole pairs of pages so that no pair spans two groups. */
+    begin = ALIGN((uint64_t)block->begin, 2 * PAGE_SIZE);
+    end = ALIGN_DOWN((uint64_t)block->begin + block->size, 2 * PAGE_SIZE);
+
+    if (begin >= end) {
+      continue;
+    }
+
     group = initmem_alloc(sizeof(struct page_group));
 
-    group->pages = initmem_alloc((block->size >> PAGE_SHIFT) * sizeof(struct phys_page));
-    group->size = block->size;
-    group->offset = block->begin;
+    group->pages = phys_to_page(begin);
+    group->size = end - begin;
+    group->offset = begin;
+    group->init_count = 0;
 
+    page_group_free_lists_init(group);
     page_group_insert(group);
   }
 
-  curr = page_groups_head.next;
-
   /*
-    For each memory block in the initial memory map's reserved group, we
-    reserve that memory block in the appropriate physical page page_group.
+    The page groups are allocated first so that all of the initial memory
+    allocator's reserved blocks are known before any pages are freed.
   */
-  for (size_t i = 0; i < initmem_info.reserved->size; ++i) {
-    block = &initmem_info.reserved->blocks[i];
+  curr = page_groups_head.next;
 
-    group = list_data(curr, struct page_group, link);
+  while (curr != &page_groups_head) {
+    page_group_init_pages(list_data(curr, struct page_group, link), page_count(MEMORY_EARLY_INIT_SIZE));
+    curr = curr->next;
+  }
 
-    while (block->begin > page_group_end(group)) {
-      curr = curr->next;
-      group = list_data(curr, struct page_group, link);
+  page_groups = list_data(page_groups_head.next, struct page_group, link);
+
+  memory_block_init();
+}
+
+/*
+  memory_deferred_init initializes the page information of the next maximum
+  order block of uninitialized pages. It returns true if any pages were
+  initialized and false once every page group is fully initialized.
+*/
+bool memory_deferred_init() {
+  struct list_link* curr = page_groups_head.next;
+
+  while (curr != &page_groups_head) {
+    if (page_group_init_pages(list_data(curr, struct page_group, link), 1)) {
+      return true;
     }
 
-    page_group_reserve(group, block->begin, page_count(block->size));
+    curr = curr->next;
   }
 
-  page_groups = list_data(page_groups_head.next, struct page_group, link);
+  return false;
 }
 
 /*
@@ -264,7 +319,7 @@ inline size_t page_group_index(const struct page_group* group, uint64_t addr) {
   "index" in the page group "group".
 */
 inline uint64_t page_group_addr(const struct page_group* group, size_t index) {
-  return page_addr(page_index(group->offset) + index);
+  return page_to_phys(&group->pages[index]);
 }
 
 /*
@@ -280,82 +335,269 @@ inline uint64_t page_group_end(const struct page_group* group) {
   page address "addr".
 */
 inline struct phys_page* page_group_get(const struct page_group* group, uint64_t addr) {
-  return &group->pages[page_group_index(group, addr)];
+  return phys_to_page(addr);
 }
 
 /*
-  page_group_is_free returns true if "count" contiguous pages are free from the
-  address "addr" in the page group "group".
+  page_group_reserve reserves "count" contiguous pages from the address "addr"
+  in the page group "page_group".
 */
-bool page_group_is_free(const struct page_group* group, uint64_t addr, size_t count) {
-  if (addr >= group->offset && addr + count * PAGE_SIZE <= page_group_end(group)) {
-    int is_free = 1;
+void page_group_reserve(struct page_group* group, uint64_t addr, size_t count) {
+  for (size_t i = 0; i < count; ++i, addr += PAGE_SIZE) {
+    page_group_get(group, addr)->flags |= PAGE_RESERVED;
+  }
+}
 
-    for (size_t i = 0; i < count; ++i, addr += PAGE_SIZE) {
-      is_free &= !(page_group_get(group, addr)->flags & PAGE_RESERVED);
+/*
+  page_group_free_lists_init initializes the free lists of the page group
+  "group".
+*/
+void page_group_free_lists_init(struct page_group* group) {
+  for (size_t i = 0; i < MAX_PAGE_ORDER; ++i) {
+    list_init(&group->free_lists[i]);
+  }
+}
 
-      if (!is_free) {
-        return false;
-      }
+/*
+  page_group_free_range frees the pages from the page group entry index
+  "begin" to "end" in the page group "group". Each unreserved page is placed
+  into the largest naturally aligned free block which contains no reserved
+  pages.
+*/
+void page_group_free_range(struct page_group* group, size_t begin, size_t end) {
+  const size_t pfn = page_index(group->offset);
+  struct phys_page* page;
+  size_t i = begin;
+  size_t j;
+  int order;
+
+  while (i < end) {
+    if (group->pages[i].flags & PAGE_RESERVED) {
+      ++i;
+      continue;
+    }
+
+    /* Find the largest aligned block which begins here and fits the range. */
+    order = MAX_PAGE_ORDER - 1;
+
+    while (order && ((pfn + i) & (order_count(order) - 1) || i + order_count(order) > end)) {
+      --order;
+    }
+
+    /* Shrink the block until it ends before the first reserved page. */
+    j = i;
+
+    while (j < i + order_count(order) && !(group->pages[j].flags & PAGE_RESERVED)) {
+      ++j;
+    }
+
+    while (i + order_count(order) > j) {
+      --order;
     }
-    return true;
+
+    page = &group->pages[i];
+    page->flags |= PAGE_FREE;
+    page->order = order;
+    list_push(&group->free_lists[order], page_free_link(page));
+
+    i += order_count(order);
   }
+}
 
-  return false;
+/*
+  page_group_init_pages initializes the information of the next "count"
+  uninitialized pages in the page group "group" and frees the ones which
+  aren't reserved. The pages are rounded up to a maximum order block boundary
+  so that no free block spans initialized and uninitialized pages. It returns
+  the number of pages which were initialized.
+*/
+size_t page_group_init_pages(struct page_group* group, size_t count) {
+  const size_t size = group->size >> PAGE_SHIFT;
+  const size_t pfn = page_index(group->offset);
+  const size_t begin = group->init_count;
+  struct initmem_block* block;
+  uint64_t block_begin;
+  uint64_t block_end;
+  size_t end;
+
+  if (begin >= size) {
+    return 0;
+  }
+
+  end = ALIGN(pfn + begin + count, order_count(MAX_PAGE_ORDER - 1)) - pfn;
+
+  if (end > size) {
+    end = size;
+  }
+
+  memset(&group->pages[begin], 0, (end - begin) * sizeof(struct phys_page));
+
+  /* Reserve the parts of the initial memory allocator's reserved blocks. */
+  for (size_t i = 0; i < initmem_info.reserved->size; ++i) {
+    block = &initmem_info.reserved->blocks[i];
+    block_begin = ALIGN_DOWN((uint64_t)block->begin, PAGE_SIZE);
+    block_end = (uint64_t)block->begin + block->size;
+
+    if (block_begin < page_group_addr(group, begin)) {
+      block_begin = page_group_addr(group, begin);
+    }
+
+    if (block_end > page_group_addr(group, end)) {
+      block_end = page_group_addr(group, end);
+    }
+
+    if (block_begin < block_end) {
+      page_group_reserve(group, block_begin, page_count(block_end - block_begin));
+    }
+  }
+
+  page_group_free_range(group, begin, end);
+  group->init_count = end;
+
+  return end - begin;
 }
 
 /*
-  page_group_reserve reserves "count" contiguous pages from the address "addr"
-  in the page group "page_group".
+  page_free_link returns the free list link of the free block which begins at
+  the physical page "page". It is shared with the other page of its pair.
 */
-void page_group_reserve(struct page_group* group, uint64_t addr, size_t count) {
-  for (size_t i = 0; i < count; ++i, addr += PAGE_SIZE) {
-    page_group_get(group, addr)->flags |= PAGE_RESERVED;
+struct list_link* page_free_link(const struct phys_page* page) {
+  return &free_links[(page - mem_map) >> 1];
+}
+
+/*
+  free_link_to_page returns the first page of the free block which is linked
+  by the free list link "link". Only one page of the pair begins a free block,
+  and only that page is marked as free.
+*/
+struct phys_page* free_link_to_page(const struct list_link* link) {
+  struct phys_page* page = &mem_map[(link - free_links) << 1];
+
+  if (!(page->flags & PAGE_FREE)) {
+    ++page;
   }
+
+  return page;
 }
 
 /*
-  page_group_clear unreserves "count" contiguous pages from the address "addr"
-  in the page group "page_group".
+  page_group_buddy returns the buddy of the block of order "order" beginning at
+  the page "page" in the page group "group". If the buddy is outside of the
+  initialized part of the page group, then NULL is returned.
 */
-void page_group_clear(struct page_group* group, uint64_t addr, size_t count) {
-  for (size_t i = 0; i < count; ++i, addr += PAGE_SIZE) {
-    page_group_get(group, addr)->flags &= ~PAGE_RESERVED;
+struct phys_page* page_group_buddy(const struct page_group* group, const struct phys_page* page, int order) {
+  const size_t pfn = page_index(group->offset);
+  size_t buddy_pfn;
+
+  buddy_pfn = page_to_pfn(page) ^ order_count(order);
+
+  if (buddy_pfn < pfn || buddy_pfn - pfn >= group->init_count) {
+    return NULL;
   }
+
+  return pfn_to_page(buddy_pfn);
 }
 
 /*
-  page_group_alloc allocates "count" contiguous pages aligned to "align" pages
-  with "gap" free pages before it in the page group "group" between "begin" and
-  "end". It returns its physical address.
+  page_group_alloc allocates "count" contiguous pages in the page group "group"
+  and returns their physical address. The allocation is rounded up to a block
+  of the next power of two pages and is naturally aligned to its size. If there
+  is no free block, then the page cache is reclaimed first.
 */
-uint64_t page_group_alloc(struct page_group* group, uint64_t begin, uint64_t end, size_t count, size_t align, size_t gap) {
-  uint64_t addr;
-  uint32_t gap_size = gap << PAGE_SHIFT;
+uint64_t page_group_alloc(struct page_group* group, size_t count) {
+  int order = count_to_order(count);
+  int i = order;
+  struct phys_page* page;
+  struct phys_page* buddy;
 
-  for (size_t i = page_group_index(group, begin + gap_size); i < page_group_index(group, end); ++i) {
-    addr = page_group_addr(group, i);
+  /*
+    Find the smallest free block which can satisfy the allocation. If there is
+    none, then more of the page group's pages are initialized.
+  */
+  while (i < MAX_PAGE_ORDER && is_list_empty(&group->free_lists[i])) {
+    ++i;
 
-    if (!page_group_is_free(group, addr, count) || addr % (align << PAGE_SHIFT) != 0) {
-      continue;
+    if (i == MAX_PAGE_ORDER && page_group_init_pages(group, 1)) {
+      i = order;
     }
+  }
 
-    if (page_group_is_free(group, addr - gap_size, count)) {
-      page_group_reserve(group, addr, count);
-      return addr;
-    }
+  /*
+    File pages which only the page cache holds are reclaimed before the
+    allocation fails, and then it is tried again.
+  */
+  if (i >= MAX_PAGE_ORDER) {
+    return page_cache_reclaim() ? page_group_alloc(group, count) : 0;
+  }
+
+  page = free_link_to_page(list_pop(&group->free_lists[i]));
+  page->flags &= ~PAGE_FREE;
+
+  /* Split the block and free the upper halves until it is the right order. */
+  while (i > order) {
+    --i;
+    buddy = page + order_count(i);
+    buddy->flags |= PAGE_FREE;
+    buddy->order = i;
+    list_push(&group->free_lists[i], page_free_link(buddy));
   }
 
-  return 0;
+  page->flags |= PAGE_RESERVED;
+  page->order = order;
+  page->ref = 1;
+
+  return page_to_phys(page);
 }
 
 /*
-  page_group_alloc_virt allocates "count" contiguous pages aligned to "align"
-  pages with "gap" free pages before it in the page group "group" and returns a
-  pointer to its virtual address.
+  page_group_alloc_virt allocates "count" contiguous pages in the page group
+  "group" and returns a pointer to their virtual address.
 */
-void* page_group_alloc_virt(struct page_group* group, size_t count, size_t align, size_t gap) {
-  return (void*)phys_to_virt(page_group_alloc(group, PHYS_OFFSET, high_memory, count, align, gap));
+void* page_group_alloc_virt(struct page_group* group, size_t count) {
+  uint64_t addr;
+
+  addr = page_group_alloc(group, count);
+
+  if (!addr) {
+    return NULL;
+  }
+
+  return (void*)phys_to_virt(addr);
+}
+
+/*
+  page_group_free frees "count" contiguous pages from the address "addr" in the
+  page group "group". The pages must have been allocated by page_group_alloc.
+*/
+void page_group_free(struct page_group* group, uint64_t addr, size_t count) {
+  int order = count_to_order(count);
+  struct phys_page* page;
+  struct phys_page* buddy;
+
+  page = phys_to_page(addr);
+  page->flags &= ~PAGE_RESERVED;
+
+  /* Merge the block with its buddy for as long as its buddy is free. */
+  while (order < MAX_PAGE_ORDER - 1) {
+    buddy = page_group_buddy(group, page, order);
+
+    if (!buddy || !(buddy->flags & PAGE_FREE) || buddy->order != order) {
+      break;
+    }
+
+    list_remove(&group->free_lists[order], page_free_link(buddy));
+    buddy->flags &= ~PAGE_FREE;
+
+    if (buddy < page) {
+      page = buddy;
+    }
+
+    ++order;
+  }
+
+  page->flags |= PAGE_FREE;
+  page->order = order;
+  list_push(&group->free_lists[order], page_free_link(page));
 }
 
 /*
@@ -417,11 +659,12 @@ struct page_group* page_to_group(const struct phys_page* page) {
   struct list_link* head = &page_groups_head;
   struct page_group* group;
   struct list_link* curr = head->next;
+  const size_t pfn = page_to_pfn(page);
 
   do {
     group = list_data(curr, struct page_group, link);
 
-    if (page >= group->pages && page < group->pages + (group->size >> PAGE_SHIFT)) {
+    if (pfn - page_index(group->offset) < group->size >> PAGE_SHIFT) {
       return group;
     }
 
@@ -432,21 +675,16 @@ struct page_group* page_to_group(const struct phys_page* page) {
 }
 
 /*
-  page_to_addr returns the physical address of the physical page "page" given
-  the page group list.
+  count_to_order returns the smallest block order which contains at least
+  "count" pages.
 */
-uint64_t page_to_addr(const struct phys_page* page) {
-  struct page_group* group;
-  uint64_t ret;
+int count_to_order(size_t count) {
+  int ret = 0;
 
-  group = page_to_group(page);
-
-  if (!group) {
-    return 0;
+  while (order_count(ret) < count) {
+    ++ret;
   }
 
-  ret = group->offset + (page - group->pages) * PAGE_SIZE;
-
   return ret;
 }
 
@@ -536,163 +774,173 @@ int initmem_free(void* ptr) {
   them.
 */
 void* memory_page_alloc(size_t count) {
-  void* data;
-  struct phys_page* page;
-  struct initmem_block* block;
-  struct initmem_block* head;
-
   if (!count) {
     return NULL;
   }
 
-  /*
-    Make sure that the page has a free page before it to store page information
-    inside.
-  */
-  data = page_group_alloc_virt(page_groups, count, count, 1);
+  return page_group_alloc_virt(page_groups, count);
+}
 
-  if (!data) {
-    return NULL;
-  }
+/*
+  memory_block_init initializes the block size classes. Each class uses the
+  smallest block page order which holds at least BLOCK_PAGE_MIN_SLOTS slots.
+*/
+void memory_block_init() {
+  struct block_class* class;
 
-  page_group_reserve(page_groups, virt_to_phys((uint32_t)data) - PAGE_SIZE, 1);
+  for (size_t i = 0; i < BLOCK_CLASSES; ++i) {
+    class = &block_classes[i];
+    class->size = 1 << (MIN_BLOCK_SHIFT + i);
+    class->order = 0;
 
-  head = (void*)((uint32_t)data - PAGE_SIZE);
-  block = (void*)((uint32_t)data - sizeof(struct initmem_block));
+    while ((PAGE_SIZE << class->order) < BLOCK_PAGE_MIN_SLOTS * class->size) {
+      ++class->order;
+    }
 
-  /* Initialize the block information to describe the page allocation. */
-  block->begin = (uint32_t)data;
-  block->size = count * PAGE_SIZE;
-  block->next = NULL;
-  block->prev = head;
+    class->count = (PAGE_SIZE << class->order) / class->size;
+    class->reserved = (sizeof(struct block_page) + class->size - 1) / class->size;
+    list_init(&class->pages_head);
+  }
+}
 
-  /* Initialize the dummy head block information to link to the previous block. */
-  page = alloc_page_init(head);
-  head->next = block;
+/*
+  size_to_block_class returns the index of the smallest block size class which
+  can hold "size" bytes.
+*/
+int size_to_block_class(size_t size) {
+  int ret = 0;
 
-  list_push(&alloc_pages_head, &page->link);
+  while ((1 << (MIN_BLOCK_SHIFT + ret)) < size) {
+    ++ret;
+  }
 
-  return data;
+  return ret;
 }
 
 /*
-  memory_block_alloc allocates a memory region under a page size and returns a
-  pointer to it.
+  memory_block_alloc allocates a memory region of at most MAX_BLOCK_SIZE bytes
+  and returns a pointer to it. The region is naturally aligned to its block
+  size class.
 */
 void* memory_block_alloc(size_t size) {
-  struct phys_page* page;
-  struct list_link* curr;
-  void* data;
-  void* ret;
-  size_t align = 4;
+  struct block_class* class;
+  struct block_page* block_page;
+  size_t i = 0;
+  size_t slot;
 
-  if (is_power_of_two(size)) {
-    align = size;
+  if (!size || size > MAX_BLOCK_SIZE) {
+    return NULL;
   }
 
-  curr = alloc_pages_head.next;
-
-  /*
-    We try to allocate in one of the existing pages.
-  */
-  while (curr != &alloc_pages_head) {
-    page = list_data(curr, struct phys_page, link);
+  class = &block_classes[size_to_block_class(size)];
 
-    if ((ret = memory_block_page_alloc(page, size, align))) {
-      return ret;
+  if (is_list_empty(&class->pages_head)) {
+    if (!block_page_alloc(class)) {
+      return NULL;
     }
-
-    curr = curr->next;
   }
 
-  /*
-    We couldn't allocate in one of the existing pages, so create a new
-    allocation page.
-  */
-  data = page_group_alloc_virt(page_groups, 1, 1, 0);
+  block_page = list_data(class->pages_head.next, struct block_page, link);
 
-  if (!data) {
-    return NULL;
+  /* Find the first word in the map with a free slot. */
+  while (block_page->map[i] == 0xffffffff) {
+    ++i;
   }
 
-  page = alloc_page_init(data);
-  list_push(&alloc_pages_head, &page->link);
+  slot = i * 32 + __builtin_ctz(~block_page->map[i]);
+  block_page->map[i] |= 1u << (slot % 32);
 
-  if ((ret = memory_block_page_alloc(page, size, align))) {
-    return ret;
+  /* A full block page can't satisfy any more allocations. */
+  if (--block_page->free == 0) {
+    list_remove(&class->pages_head, &block_page->link);
   }
 
-  page_group_clear(page_groups, virt_to_phys((uint32_t)data), 1);
-  list_remove(&alloc_pages_head, &page->link);
-  return NULL;
+  return (char*)block_page + slot * class->size;
 }
 
 /*
-  alloc_page_init initializes the physical page correlating to the virtual
-  address specified by "data" for memory allocation and returns it.
+  memory_block_free frees the block which "ptr" points to. "page" is the page
+  information of the page which contains "ptr".
 */
-struct phys_page* alloc_page_init(void* data) {
-  struct phys_page* page;
-  struct initmem_block* block;
+void memory_block_free(void* ptr, struct phys_page* page) {
+  struct block_class* class;
+  struct block_page* block_page;
+  size_t slot;
 
-  page = page_group_get(page_groups, virt_to_phys((uint32_t)data));
+  class = &block_classes[page->order];
+  block_page = (struct block_page*)ALIGN_DOWN((uint32_t)ptr, PAGE_SIZE << class->order);
+  slot = ((uint32_t)ptr - (uint32_t)block_page) / class->size;
 
-  block = data;
-  block->begin = (uint32_t)data + sizeof(struct initmem_block);
-  block->size = 0;
-  block->next = NULL;
-  block->prev = NULL;
+  block_page->map[slot / 32] &= ~(1u << (slot % 32));
 
-  return page;
+  /* A full block page can satisfy allocations again. */
+  if (block_page->free++ == 0) {
+    list_push(&class->pages_head, &block_page->link);
+  }
+
+  /*
+    If the block page is empty and isn't the only one with free slots, then
+    we free it.
+  */
+  if (block_page->free == class->count - class->reserved && (class->pages_head.next != &block_page->link || block_page->link.next != &class->pages_head)) {
+    list_remove(&class->pages_head, &block_page->link);
+    block_page_free(class, block_page);
+  }
 }
 
 /*
-  memory_block_page_alloc allocates a block of "size" bytes aligned to "align"
-  bytes from the page information "page" and returns a pointer to it.
+  block_page_alloc allocates a block page for the block size class "class",
+  links it into the class's block pages, and returns it.
 */
-void* memory_block_page_alloc(struct phys_page* page, size_t size, size_t align) {
-  void* page_data = (void*)phys_to_virt(page_to_addr(page));
-  struct initmem_block* curr = (struct initmem_block*)page_data;
-  struct initmem_block next;
+struct block_page* block_page_alloc(struct block_class* class) {
+  struct block_page* ret;
+  struct phys_page* page;
 
-  if (!size || size > MAX_BLOCK_SIZE) {
+  ret = page_group_alloc_virt(page_groups, order_count(class->order));
+
+  if (!ret) {
     return NULL;
   }
 
-  next.size = size;
+  page = virt_to_page((uint32_t)ret);
 
-  while (curr) {
-    struct initmem_block* next_addr = (struct initmem_block*)(ALIGN(curr->begin + curr->size + sizeof(struct initmem_block), align) - sizeof(struct initmem_block));
+  /* Every page records its class so that any block can find its header. */
+  for (size_t i = 0; i < order_count(class->order); ++i) {
+    page[i].flags |= PAGE_BLOCK;
+    page[i].order = class - block_classes;
+  }
 
-    next.begin = (uint32_t)next_addr + sizeof(struct initmem_block);
-    next.prev = curr;
+  memset(ret, 0, sizeof(struct block_page));
+  ret->free = class->count - class->reserved;
 
-    /* We allocate after the current block. */
-    if (!curr->next) {
-      if (next.begin + size >= (uint32_t)page_data + PAGE_SIZE) {
-        return NULL;
-      }
+  for (size_t i = 0; i < class->reserved; ++i) {
+    ret->map[i / 32] |= 1u << (i % 32);
+  }
 
-      next.next = NULL;
-      *next_addr = next;
-      curr->next = next_addr;
-      return (uint32_t*)next.begin;
-    }
+  /* Slots which don't exist are marked as used. */
+  for (size_t i = class->count; i < BLOCK_PAGE_MAP_SIZE * 32; ++i) {
+    ret->map[i / 32] |= 1u << (i % 32);
+  }
 
-    /* We allocate between the current block and the next block. */
-    if (next.begin + size <= (uint32_t)curr->next) {
-      next.next = curr->next;
-      *next_addr = next;
-      curr->next->prev = next_addr;
-      curr->next = next_addr;
-      return (uint32_t*)next.begin;
-    }
+  list_push(&class->pages_head, &ret->link);
 
-    curr = curr->next;
+  return ret;
+}
+
+/*
+  block_page_free frees the block page "block_page" of the block size class
+  "class".
+*/
+void block_page_free(struct block_class* class, struct block_page* block_page) {
+  struct phys_page* page;
+
+  page = virt_to_page((uint32_t)block_page);
 
+  for (size_t i = 0; i < order_count(class->order); ++i) {
+    page[i].flags &= ~PAGE_BLOCK;
   }
 
-  return NULL;
+  page_group_free(page_groups, virt_to_phys((uint32_t)block_page), order_count(class->order));
 }
 
 /*
@@ -732,10 +980,10 @@ struct phys_page* pages_alloc(size_t count, int zone) {
       continue;
     }
 
-    addr = page_group_alloc(group, begin, end, count, count, 0);
+    addr = page_group_alloc(group, count);
 
     if (addr) {
-      return page_group_get(group, addr);
+      return phys_to_page(addr);
     }
 
     curr = curr->next;
@@ -745,26 +993,58 @@ struct phys_page* pages_alloc(size_t count, int zone) {
 }
 
 /*
-  pages_free frees "count" pages from the physical address "addr".
+  pages_split splits the block of "count" pages beginning at the physical page
+  "page" into single pages which each hold a reference, so that they can be
+  shared and freed individually.
+*/
+void pages_split(struct phys_page* page, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    page[i].flags = page->flags;
+    page[i].order = 0;
+    page[i].ref = 1;
+  }
+}
+
+/*
+  pages_free frees "count" pages beginning at the physical page "page".
 */
 void pages_free(struct phys_page* page, size_t count) {
-  uint64_t addr;
-  struct list_link* curr;
   struct page_group* group;
 
-  addr = page_to_addr(page);
-  curr = page_groups_head.next;
+  group = page_to_group(page);
 
-  do {
-    group = list_data(curr, struct page_group, link);
+  if (group) {
+    page_group_free(group, page_to_phys(page), count);
+  }
+}
 
-    if (addr >= group->offset && addr < page_group_end(group)) {
-      page_group_clear(group, addr, count);
-      return;
-    }
+/*
+  page_get takes a reference to the block of pages beginning at the physical
+  page "page".
+*/
+void page_get(struct phys_page* page) {
+  uint32_t cpsr;
 
-    curr = curr->next;
-  } while(curr != &page_groups_head);
+  cpsr = save_interrupts();
+  ++page->ref;
+  restore_interrupts(cpsr);
+}
+
+/*
+  page_put drops a reference to the block of pages beginning at the physical
+  page "page". When the last reference is dropped the block is freed.
+*/
+void page_put(struct phys_page* page) {
+  uint32_t cpsr;
+  bool last;
+
+  cpsr = save_interrupts();
+  last = --page->ref == 0;
+  restore_interrupts(cpsr);
+
+  if (last) {
+    pages_free(page, order_count(page->order));
+  }
 }
 
 /*
@@ -787,35 +1067,19 @@ void* memory_alloc(size_t size) {
   memory_free frees the block which "ptr" points to.
 */
 void memory_free(void* ptr) {
-  struct initmem_block* block;
   struct phys_page* page;
 
-  block = ptr_to_block(ptr);
-
   if (!ptr) {
     return;
   }
 
-  if (block->prev) {
-    block->prev->next = block->next;
-  }
-
-  if (block->next) {
-    block->next->prev = block->prev;
-  }
+  page = virt_to_page((uint32_t)ptr);
 
-  /* Handle memory allocated by the page allocator. */
-  if (block->size > MAX_BLOCK_SIZE) {
-    page_group_clear(page_groups, virt_to_phys((uint32_t)block->begin), block->size >> PAGE_SHIFT);
+  /* Handle memory allocated by the block allocator. */
+  if (page->flags & PAGE_BLOCK) {
+    memory_block_free(ptr, page);
+    return;
   }
 
-  /*
-    If the allocation page is empty, then unreserve it and remove it from the
-    allocation page list.
-  */
-  if (!block->prev->prev && !block->prev->next) {
-    page = page_group_get(page_groups, virt_to_phys((uint32_t)block->prev));
-    page_group_clear(page_groups, virt_to_phys((uint32_t)block->prev), 1);
-    list_remove(&alloc_pages_head, &page->link);
-  }
+  page_group_free(page_groups, virt_to_phys((uint32_t)ptr), order_count(page->order));
 }
@@ -9,7 +9,14 @@
 #include <stdint.h>
 
 #define MEMORY_MAP_GROUP_LENGTH 128
-#define MAX_BLOCK_SIZE (PAGE_SIZE - sizeof(struct initmem_block))
+#define MAX_PAGE_ORDER 11
+#define MEMORY_EARLY_INIT_SIZE 0x4000000
+#define MIN_BLOCK_SHIFT 4
+#define MAX_BLOCK_SHIFT 11
+#define MAX_BLOCK_SIZE (1 << MAX_BLOCK_SHIFT)
+#define BLOCK_CLASSES (MAX_BLOCK_SHIFT - MIN_BLOCK_SHIFT + 1)
+#define BLOCK_PAGE_MIN_SLOTS 16
+#define BLOCK_PAGE_MAP_SIZE ((PAGE_SIZE >> MIN_BLOCK_SHIFT) / 32)
 
 /*
   virt_to_phys returns a physical address from a virtual address "x".
@@ -24,6 +31,22 @@
 #define page_count(x) (((x) + PAGE_SIZE - 1) >> PAGE_SHIFT)
 #define page_index(x) ((x) >> PAGE_SHIFT)
 #define page_addr(x) ((x) << PAGE_SHIFT)
+#define order_count(x) (1 << (x))
+
+/*
+  pfn_to_page returns the page information of the page frame number "pfn", and
+  page_to_pfn returns the page frame number of the page information "page".
+  Both index the flat page information array "mem_map" which covers all of
+  physical memory.
+*/
+#define PHYS_PFN_OFFSET page_index(PHYS_OFFSET)
+#define pfn_to_page(pfn) (&mem_map[(pfn) - PHYS_PFN_OFFSET])
+#define page_to_pfn(page) ((size_t)((page) - mem_map) + PHYS_PFN_OFFSET)
+
+#define phys_to_page(x) pfn_to_page(page_index(x))
+#define page_to_phys(page) ((uint64_t)page_to_pfn(page) << PAGE_SHIFT)
+#define virt_to_page(x) phys_to_page(virt_to_phys(x))
+#define page_to_virt(page) phys_to_virt(page_to_phys(page))
 
 #define ALIGN_UP(a, b) ((a + b - 1) & ~(b - 1))
 #define ALIGN_DOWN(a, b) ((a) & ~((b) - 1))
@@ -31,7 +54,6 @@
 #define IS_ALIGNED(a, b) (ALIGN(a, b) == a)
 
 #define is_power_of_two(num) (num != 0 && (num & (num - 1)) == 0)
-#define ptr_to_block(ptr) ((struct initmem_block*)((uint32_t)ptr - sizeof(struct initmem_block)))
 
 /*
   enum initmem_block_flags represents the attribute of a memory block.
@@ -68,32 +90,77 @@ struct initmem_info {
   struct initmem_group* reserved;
 };
 
+/*
+  enum memory_page_flags represents the attributes of a physical page. A page
+  is either reserved, or it is free. Only the first page of a free block is
+  marked as free, and it is the page which is linked into a free list. Pages
+  which back small memory blocks are additionally marked as block pages.
+*/
 enum memory_page_flags {
   PAGE_NONE = 0x0,
-  PAGE_RESERVED = 0x1
+  PAGE_RESERVED = 0x1,
+  PAGE_FREE = 0x2,
+  PAGE_BLOCK = 0x4
 };
 
 /*
-  struct phys_page represents the information of a physical page.
+  struct phys_page represents the information of a physical page. "order" is
+  the order of the block which the page begins, if it begins one. For block
+  pages it is instead the index of the block size class. "ref" is the number
+  of references to the page. The flags, order and reference count are packed
+  into a single word. Free blocks are linked through "free_links" instead, and
+  block pages through their header.
 */
 struct phys_page {
-  int flags;
-  struct list_link link;
+  unsigned int flags : 8;
+  unsigned int order : 4;
+  unsigned int ref : 20;
 };
 
 /*
   struct page_group represents a group of pages. Page groups are linked into a
   linked list with successive elements mapping higher addresses. Each page
-  group contains the underlying page information data "pages"; its size "size";
-  the first address "offset"; and a pointer to the next page group "next".
+  group contains the underlying page information data "pages", which is its
+  slice of "mem_map"; its size "size"; the first address "offset"; the number
+  of pages whose information is initialized "init_count"; the free block lists
+  of each order "free_lists"; and a pointer to the next page group "next".
 */
 struct page_group {
   struct phys_page* pages;
   uint64_t size;
   uint64_t offset;
+  size_t init_count;
+  struct list_link free_lists[MAX_PAGE_ORDER];
   struct list_link link;
 };
 
+/*
+  struct block_page represents the header of a block page. A block page is a
+  block of pages which is split into equally sized slots of a single block
+  size class. The header occupies the first slots, and "map" has a bit set for
+  every used slot. A block page with free slots is linked into its class by
+  "link".
+*/
+struct block_page {
+  size_t free;
+  struct list_link link;
+  uint32_t map[BLOCK_PAGE_MAP_SIZE];
+};
+
+/*
+  struct block_class represents a block size class. Each of its block pages
+  is of order "order" and has "count" slots of "size" bytes, of which the
+  first "reserved" slots hold the header. Block pages with free slots are
+  linked in "pages_head".
+*/
+struct block_class {
+  size_t size;
+  int order;
+  size_t count;
+  size_t reserved;
+  struct list_link pages_head;
+};
+
 /*
   enum page_zone represents the a physical memory zone. There are two primary
   zones. Lowmem is the area of physical memory used by the kernel's linear
@@ -108,8 +175,10 @@ enum page_zone {
 };
 
 extern struct initmem_info initmem_info;
-extern struct list_link alloc_pages_head;
+extern struct block_class block_classes[BLOCK_CLASSES];
 
+extern struct phys_page* mem_map;
+extern struct list_link* free_links;
 extern struct page_group* page_groups;
 extern struct list_link page_groups_head;
 
@@ -117,6 +186,7 @@ extern uint32_t high_memory;
 
 void initmem_init();
 void memory_alloc_init();
+bool memory_deferred_init();
 
 void update_memory_map();
 
@@ -129,27 +199,38 @@ size_t page_group_index(const struct page_group* group, uint64_t addr);
 uint64_t page_group_addr(const struct page_group* group, size_t index);
 uint64_t page_group_end(const struct page_group* group);
 struct phys_page* page_group_get(const struct page_group* group, uint64_t addr);
-bool page_group_is_free(const struct page_group* group, uint64_t addr, size_t count);
 void page_group_reserve(struct page_group* group, uint64_t addr, size_t count);
-void page_group_clear(struct page_group* group, uint64_t addr, size_t count);
-uint64_t page_group_alloc(struct page_group* group, uint64_t begin, uint64_t end, size_t count, size_t align, size_t gap);
-void* page_group_alloc_virt(struct page_group* group, size_t count, size_t align, size_t gap);
+void page_group_free_lists_init(struct page_group* group);
+void page_group_free_range(struct page_group* group, size_t begin, size_t end);
+size_t page_group_init_pages(struct page_group* group, size_t count);
+struct list_link* page_free_link(const struct phys_page* page);
+struct phys_page* free_link_to_page(const struct list_link* link);
+struct phys_page* page_group_buddy(const struct page_group* group, const struct phys_page* page, int order);
+uint64_t page_group_alloc(struct page_group* group, size_t count);
+void* page_group_alloc_virt(struct page_group* group, size_t count);
+void page_group_free(struct page_group* group, uint64_t addr, size_t count);
 int page_group_insert(struct page_group* group);
 struct page_group* page_to_group(const struct phys_page* page);
-uint64_t page_to_addr(const struct phys_page* page);
+int count_to_order(size_t count);
 
 void* initmem_phys_alloc(size_t size);
 void* initmem_alloc(size_t size);
 int initmem_free(void* ptr);
 
 void* memory_page_alloc(size_t count);
+void memory_block_init();
+int size_to_block_class(size_t size);
 void* memory_block_alloc(size_t size);
+void memory_block_free(void* ptr, struct phys_page* page);
 
-struct phys_page* alloc_page_init(void* data);
-void* memory_block_page_alloc(struct phys_page* page, size_t size, size_t align);
+struct block_page* block_page_alloc(struct block_class* class);
+void block_page_free(struct block_class* class, struct block_page* block_page);
 
 struct phys_page* pages_alloc(size_t count, int zone);
+void pages_split(struct phys_page* page, size_t count);
 void pages_free(struct phys_page* page, size_t count);
+void page_get(struct phys_page* page);
+void page_put(struct phys_page* page);
 
 void* memory_alloc(size_t size);
 void memory_free(void* ptr);
@@ -21,29 +21,51 @@
 #include <drivers/pl011.h>
 #include <drivers/pl180.h>
 #include <drivers/sp804.h>
+#include <kernel/buffer.h>
 #include <kernel/file.h>
 #include <kernel/memory.h>
+#include <kernel/page_cache.h>
+#include <kernel/page_table.h>
 #include <kernel/process.h>
+#include <kernel/vmalloc.h>
 #include <lib/string.h>
 #include <limits.h>
 
+struct kmem_cache page_region_cache = KMEM_CACHE_INIT(page_region_cache, "page_region", sizeof(struct page_region), 0, page_region_ctor);
+
 const struct descriptor_bits pmd_section_bits = {
   .ap = {10, 11, 15},
-  .xn = 4
+  .xn = 4,
+  .ng = 17
 };
 
 const struct descriptor_bits pte_bits = {
   .ap = {4, 5, 9},
-  .xn = 0
+  .xn = 0,
+  .ng = 11
+};
+
+const struct descriptor_bits large_pte_bits = {
+  .ap = {4, 5, 9},
+  .xn = 15,
+  .ng = 11
 };
 
+/*
+  "asid_generation" is the current ASID generation in the bits above the ASID
+  and "next_asid" is the next ASID to be allocated in it. ASID 0 is reserved
+  for switching memory contexts.
+*/
+uint32_t asid_generation = 1 << ASID_BITS;
+uint32_t next_asid = 1;
+
 /*
   init_paging initializes the kernel's paging and maps required memory regions.
   Currently the kernel is mapped using 1MB sections. These sections are
   replaced with 4KB small pages where required.
 */
 void init_paging() {
-  create_page_region_bounds(current->mem);
+  create_page_region_bounds(current->mem, VADDR_SPACE_END);
   init_pgd();
   map_kernel();
   map_peripherals();
@@ -52,6 +74,163 @@ void init_paging() {
   flush_pgd();
 }
 
+/*
+  asid_alloc allocates an ASID for the memory context "mem" in the current ASID
+  generation. If the generation's ASIDs are exhausted, then a new generation is
+  started, which invalidates the ASIDs of all other memory contexts. The TLB
+  must then be flushed after switching to "mem".
+*/
+void asid_alloc(struct memory_info* mem) {
+  if (next_asid > ASID_MASK) {
+    asid_generation += 1 << ASID_BITS;
+    next_asid = 1;
+  }
+
+  mem->context_id = asid_generation | next_asid++;
+}
+
+/*
+  switch_memory_info switches the userspace translation table and ASID to those
+  of the memory context "mem". The kernel translation table in TTBR1 is never
+  switched. The TLB is only flushed when the ASIDs roll over to a
+  new generation, so other memory contexts keep their TLB entries.
+*/
+void switch_memory_info(struct memory_info* mem) {
+  uint32_t cpsr;
+  bool rollover = false;
+
+  cpsr = save_interrupts();
+
+  if (is_asid_stale(mem)) {
+    rollover = next_asid > ASID_MASK;
+    asid_alloc(mem);
+  }
+
+  set_context(virt_to_phys((uint32_t)mem->pgd), mem->context_id & ASID_MASK);
+
+  if (rollover) {
+    flush_pgd();
+  }
+
+  restore_interrupts(cpsr);
+}
+
+/*
+  flush_page invalidates the TLB entry of the virtual address "v_addr" in the
+  memory context "mem". A memory context from an old ASID generation has no
+  TLB entries, so nothing is invalidated for it. Kernel mappings are global,
+  so they are invalidated for every ASID.
+*/
+void flush_page(struct memory_info* mem, uint32_t v_addr) {
+  if (v_addr >= USER_VADDR_END) {
+    flush_pte(ALIGN_DOWN(v_addr, PAGE_SIZE));
+    return;
+  }
+
+  if (is_asid_stale(mem)) {
+    return;
+  }
+
+  flush_pte_asid(ALIGN_DOWN(v_addr, PAGE_SIZE) | (mem->context_id & ASID_MASK));
+}
+
+/*
+  is_asid_stale returns if the ASID of the memory context "mem" is from an old
+  ASID generation.
+*/
+bool is_asid_stale(const struct memory_info* mem) {
+  return (mem->context_id ^ asid_generation) >> ASID_BITS;
+}
+
+/*
+  tlb_gather_init initializes the TLB invalidation batch "tlb" for the memory
+  context "mem".
+*/
+void tlb_gather_init(struct tlb_gather* tlb, struct memory_info* mem) {
+  tlb->mem = mem;
+  tlb->begin = 0;
+  tlb->last = 0;
+  tlb->count = 0;
+}
+
+/*
+  tlb_gather_page adds the page containing the virtual address "v_addr" to the
+  TLB invalidation batch "tlb".
+*/
+void tlb_gather_page(struct tlb_gather* tlb, uint32_t v_addr) {
+  v_addr = ALIGN_DOWN(v_addr, PAGE_SIZE);
+
+  if (!tlb->count || v_addr < tlb->begin) {
+    tlb->begin = v_addr;
+  }
+
+  if (!tlb->count || v_addr > tlb->last) {
+    tlb->last = v_addr;
+  }
+
+  ++tlb->count;
+}
+
+/*
+  tlb_gather_range adds the pages of the virtual address region beginning at
+  "v_addr" of size "size" to the TLB invalidation batch "tlb".
+*/
+void tlb_gather_range(struct tlb_gather* tlb, uint32_t v_addr, uint32_t size) {
+  if (!size) {
+    return;
+  }
+
+  tlb_gather_page(tlb, v_addr);
+  tlb_gather_page(tlb, v_addr + size - 1);
+  tlb->count += page_count(size) - 2;
+}
+
+/*
+  tlb_gather_finish invalidates the TLB entries of the pages in the TLB
+  invalidation batch "tlb" and then waits for the invalidation once. If the
+  batch spans more than TLB_GATHER_MAX_PAGES pages, then every TLB entry of the
+  memory context's ASID is invalidated instead. Kernel mappings are global, so
+  a batch with any of them is invalidated for every ASID.
+*/
+void tlb_gather_finish(struct tlb_gather* tlb) {
+  const uint32_t asid = tlb->mem->context_id & ASID_MASK;
+  const bool user = tlb->last < USER_VADDR_END;
+  size_t count;
+
+  if (!tlb->count) {
+    return;
+  }
+
+  count = page_index(tlb->last - tlb->begin) + 1;
+  tlb->count = 0;
+
+  if (user && is_asid_stale(tlb->mem)) {
+    return;
+  }
+
+  if (count > TLB_GATHER_MAX_PAGES) {
+    if (user) {
+      flush_asid(asid);
+    }
+    else {
+      flush_pgd();
+    }
+
+    return;
+  }
+
+  for (uint32_t v_addr = tlb->begin; count; v_addr += PAGE_SIZE, --count) {
+    if (user) {
+      invalidate_pte_asid(v_addr | asid);
+    }
+    else {
+      invalidate_pte(v_addr);
+    }
+  }
+
+  sync_tlb();
+}
+
 /*
   init_pgd initializes the page global directory by clearing all the page table
   entries which are not used by the kernel.
@@ -165,6 +344,14 @@ void* create_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr,
       step = PMD_SIZE;
       create_section_mapping(mem, v_addr, p_addr, step, flags);
     }
+    else if (IS_ALIGNED(v_addr, LARGE_PAGE_SIZE) && IS_ALIGNED(p_addr, LARGE_PAGE_SIZE) && v_addr + LARGE_PAGE_SIZE - 1 <= end) {
+      step = LARGE_PAGE_SIZE;
+      retval = map_large_page(mem, v_addr, p_addr, flags);
+
+      if (!retval) {
+        return NULL;
+      }
+    }
     else {
       step = PAGE_SIZE;
       retval = create_page_mapping(mem, v_addr, p_addr, step, flags);
@@ -180,14 +367,19 @@ void* create_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr,
   }
 
   region = create_page_region(ret, count, flags);
-  insert_page_region(mem, region);
+
+  if (!region || insert_page_region(mem, region) < 0) {
+    free_page_region(region);
+    return NULL;
+  }
 
   return (void*)ret;
 }
 
 /*
   remove_mapping removes mapping from the virtual address "v_addr" of "size"
-  bytes from the memory context "mem" if it exists.
+  bytes from the memory context "mem" if it exists. The pages which the
+  removed part of the page regions held are released.
 */
 int remove_mapping(struct memory_info* mem, uint32_t v_addr, uint32_t size) {
   uint32_t curr_addr = v_addr;
@@ -195,22 +387,26 @@ int remove_mapping(struct memory_info* mem, uint32_t v_addr, uint32_t size) {
   size_t i = 0;
   const uint32_t count = page_count(size);
   const struct list_link* pages_head = &mem->pages_head;
-  struct list_link* curr = pages_head->next;
-  uint32_t end = v_addr + size;
+  struct list_link* curr;
+  struct list_link* next;
+  uint32_t end;
   uint32_t* pmd;
-  uint32_t pmd_page_table;
-  uint32_t* page_table;
   uint32_t step;
   struct page_region* region;
   struct page_region* region_split;
+  uint32_t region_end;
   size_t index;
+  struct tlb_gather tlb;
 
   size = ALIGN(size, PAGE_SIZE);
+  end = v_addr + size;
 
   if (!is_region_mapped(mem, v_addr, size)) {
     return -1;
   }
 
+  tlb_gather_init(&tlb, mem);
+
   /* Remove the mapping from the translation tables. */
   while (i < count) {
     pmd = addr_to_pmd(pgd, curr_addr);
@@ -220,88 +416,86 @@ int remove_mapping(struct memory_info* mem, uint32_t v_addr, uint32_t size) {
       Otherwise, remove the page from the page table.
     */
     if (is_pmd_section(pmd)) {
-      page_table = memory_alloc(PAGE_TABLE_SIZE);
-
-      if (!page_table) {
+      if (alloc_pmd_page_table(mem, pmd) < 0) {
+        tlb_gather_finish(&tlb);
         return -1;
       }
 
-      pmd_page_table = create_pmd_page_table(page_table);
-      remap_section(mem, pmd, pmd_page_table);
-
-      *pmd = pmd_page_table;
       continue;
     }
     else {
       step = PAGE_SIZE;
       pte_clear(pmd, curr_addr);
+      tlb_gather_page(&tlb, curr_addr);
     }
 
     curr_addr += step;
     i += page_count(step);
   }
 
+  tlb_gather_finish(&tlb);
+
   curr_addr = v_addr;
-  step = 0;
+  curr = &find_page_region(mem, v_addr)->link;
 
-  /* Update the page regions to reflect the removal. */
-  while (curr != pages_head) {
+  /*
+    Update the page regions to reflect the removal. They are contiguous from
+    "v_addr" to "end" since the region is mapped.
+  */
+  while (curr != pages_head && curr_addr < end) {
     region = list_data(curr, struct page_region, link);
-
-    if (curr_addr == end) {
-      break;
-    }
-
-    /*
-      If the page region to be removed isn't contained in the current page
-      region, then skip it.
-    */
-    if (curr_addr >= page_region_end(region) || curr_addr + size < region->begin) {
-      curr = curr->next;
-      continue;
-    }
+    region_end = page_region_end(region);
+    next = curr->next;
 
     /*
       If the page region to be removed spans the current page region region,
       then remove the entire current page region. Otherwise, handle carving the
       page region to be removed out of the current page region.
     */
-    if (curr_addr == region->begin && end >= page_region_end(region)) {
+    if (curr_addr == region->begin && end >= region_end) {
       remove_page_region(mem, region);
-      step = page_region_size(region);
     }
+    /* Remove region's left side. */
+    else if (curr_addr == region->begin) {
+      trim_page_region(mem, region, page_index(end - region->begin));
+    }
+    /* Remove region's right side. */
+    else if (end >= region_end) {
+      index = page_index(curr_addr - region->begin);
+
+      put_page_region_pages(region, index, region->count);
+      region->count = index;
+      update_page_region(mem, region);
+    }
+    /* Remove region's center. */
     else {
-      /* Remove region's left side. */
-      if (curr_addr == region->begin) {
-        step = end - curr_addr;
+      index = page_index(curr_addr - region->begin);
+      region_split = split_page_region(mem, region, index);
 
-        region->begin = end;
-        region->count -= page_count(step);
+      if (!region_split) {
+        return -1;
       }
-      /* Remove region's right side. */
-      else if (end >= page_region_end(region)) {
-        step = page_region_end(region) - curr_addr;
 
-        region->count -= page_count(step);
-      }
-      /* Remove region's center. */
-      else {
-        step = size;
-        index = page_index(curr_addr) - page_index(region->begin);
-
-        region_split = split_page_region(region, index);
-        region_split->begin += step;
-        region_split->count -= page_count(step);
-      }
+      trim_page_region(mem, region_split, page_count(size));
     }
 
-    curr_addr += step;
-    curr = curr->next;
+    curr_addr = region_end;
+    curr = next;
   }
 
   return 0;
 }
 
+/*
+  map_page maps the virtual page containing "v_addr" to the physical page at
+  "p_addr" in the memory context "mem" with the memory flags "flags". Unlike
+  create_mapping, it doesn't change the page regions, so it is used to fill in
+  the pages of an existing page region.
+*/
+void* map_page(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, int flags) {
+  return create_page_mapping(mem, ALIGN_DOWN(v_addr, PAGE_SIZE), p_addr, PAGE_SIZE, flags);
+}
+
 /*
   create_section_mapping creates a linear mapping in the memory context "mem"
   from the virtual address "v_addr" to the physical address "p_addr" spanning
@@ -336,8 +530,6 @@ void* create_page_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_a
   uint32_t pmd_begin;
   uint32_t pmd_end;
   uint32_t end = v_addr + size;
-  uint32_t* page_table;
-  uint32_t pmd_page_table;
 
   pgd = mem->pgd;
 
@@ -346,24 +538,8 @@ void* create_page_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_a
     pmd_begin = pmd_to_addr(pgd, pmd);
     pmd_end = pmd_begin + PMD_SIZE - 1;
 
-    /*
-      This pmd isn't a page table, so we will allocate and remap what was there
-      before.
-    */
-    if (!is_pmd_page_table(pmd)) {
-      page_table = memory_alloc(PAGE_TABLE_SIZE);
-
-      if (!page_table) {
-        return NULL;
-      }
-
-      pmd_page_table = create_pmd_page_table(page_table);
-
-      if (is_pmd_section(pmd)) {
-        remap_section(mem, pmd, pmd_page_table);
-      }
-
-      *pmd = pmd_page_table;
+    if (alloc_pmd_page_table(mem, pmd) < 0) {
+      return NULL;
     }
 
     while (v_addr < pmd_end && v_addr < end) {
@@ -377,6 +553,105 @@ void* create_page_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_a
   return (void*)v_addr;
 }
 
+/*
+  map_large_page maps the 64KB large page at the physical address "p_addr" to
+  the virtual address "v_addr" in the memory context "mem" with the memory
+  flags "flags". Both addresses must be aligned to LARGE_PAGE_SIZE. A large
+  page descriptor is repeated in all the page table entries it covers.
+*/
+void* map_large_page(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, int flags) {
+  uint32_t* pmd;
+  uint32_t* pte;
+  uint32_t d;
+
+  pmd = addr_to_pmd(mem->pgd, v_addr);
+
+  if (alloc_pmd_page_table(mem, pmd) < 0) {
+    return NULL;
+  }
+
+  pte = addr_to_pte(pmd, v_addr);
+  d = create_large_pte(p_addr, flags);
+
+  for (size_t i = 0; i < PAGES_PER_LARGE_PAGE; ++i) {
+    if (!pte[i]) {
+      ++*page_table_count(pmd_to_page_table(pmd));
+    }
+
+    pte[i] = d;
+  }
+
+  return (void*)v_addr;
+}
+
+/*
+  map_block maps the naturally aligned block of "size" bytes at the physical
+  address "p_addr" to the virtual address "v_addr" in the memory context "mem"
+  with the memory flags "flags". A block of PMD_SIZE is mapped with a section
+  and one of LARGE_PAGE_SIZE with a large page. Like map_page, it doesn't
+  change the page regions.
+*/
+void* map_block(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, uint32_t size, int flags) {
+  if (size == PMD_SIZE) {
+    return create_section_mapping(mem, v_addr, p_addr, size, flags);
+  }
+  else if (size == LARGE_PAGE_SIZE) {
+    return map_large_page(mem, v_addr, p_addr, flags);
+  }
+
+  return create_page_mapping(mem, v_addr, p_addr, size, flags);
+}
+
+/*
+  alloc_pmd_page_table makes the pmd "pmd" in the memory context "mem" a page
+  table if it isn't one already. If it was a section, then the section is
+  remapped using pages. It returns 0 on success.
+*/
+int alloc_pmd_page_table(struct memory_info* mem, uint32_t* pmd) {
+  uint32_t* page_table;
+  uint32_t pmd_page_table;
+
+  if (is_pmd_page_table(pmd)) {
+    return 0;
+  }
+
+  page_table = page_table_alloc();
+
+  if (!page_table) {
+    return -1;
+  }
+
+  pmd_page_table = create_pmd_page_table(page_table);
+
+  if (is_pmd_section(pmd)) {
+    remap_section(mem, pmd, pmd_page_table);
+  }
+
+  *pmd = pmd_page_table;
+
+  return 0;
+}
+
+/*
+  split_large_page replaces the large page which contains the virtual address
+  "v_addr" in the page table of the pmd "pmd" with small pages, so that its
+  pages can be changed individually. The caller must flush the TLB entry of
+  any address in it.
+*/
+void split_large_page(uint32_t* pmd, uint32_t v_addr) {
+  uint32_t* pte;
+  uint32_t p_addr;
+  int flags;
+
+  pte = addr_to_pte(pmd, ALIGN_DOWN(v_addr, LARGE_PAGE_SIZE));
+  p_addr = *pte & 0xffff0000;
+  flags = get_descriptor_protection(*pte, &large_pte_bits);
+
+  for (size_t i = 0; i < PAGES_PER_LARGE_PAGE; ++i) {
+    pte[i] = create_pte(p_addr + page_addr(i), flags);
+  }
+}
+
 /*
   remap_section remaps the existing section in the memory context "mem"
   specified by "pmd" as pages in the page table specified by "pmd_page_table"
@@ -407,45 +682,91 @@ void remap_section(struct memory_info* mem, uint32_t* pmd, uint32_t pmd_page_tab
   always mapped.
 */
 bool is_region_mapped(struct memory_info* mem, uint32_t begin, uint32_t size) {
-  const struct list_link* pages_head = &mem->pages_head;
-  struct list_link* curr = pages_head->next;
   struct page_region* begin_region;
   struct page_region* end_region;
 
-  while (curr != pages_head) {
-    begin_region = list_data(curr, struct page_region, link);
-    end_region = find_end_contig_page_region(mem, begin_region);
-
-    if (begin >= begin_region->begin && begin + size <= page_region_end(end_region)) {
-      return true;
-    }
+  begin_region = find_page_region(mem, begin);
 
-    curr = end_region->link.next;
+  if (!begin_region) {
+    return false;
   }
 
-  return false;
+  end_region = find_end_contig_page_region(mem, begin_region);
+
+  return begin + size <= page_region_end(end_region);
 }
 
 /*
   find_unmapped_region finds a region in the memory context "mem" of size
-  "size". On success, It returns a pointer to the region.
+  "size". On success, It returns a pointer to the region. The lowest gap which
+  fits is found by skipping the subtrees whose largest gap is too small.
 */
 void* find_unmapped_region(struct memory_info* mem, uint32_t size) {
+  struct tree_node* node = mem->pages_root.node;
+  struct page_region* region;
+
+  size = ALIGN(size, PAGE_SIZE);
+
+  if (!node || tree_data(node, struct page_region, node)->max_gap < size) {
+    return NULL;
+  }
+
+  while (node) {
+    region = tree_data(node, struct page_region, node);
+
+    if (node->left && tree_data(node->left, struct page_region, node)->max_gap >= size) {
+      node = node->left;
+    }
+    else if (region->gap >= size) {
+      return (void*)page_region_end(list_data(region->link.prev, struct page_region, link));
+    }
+    else {
+      node = node->right;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+  find_unmapped_region_between finds a region in the memory context "mem" of
+  size "size" which is between the virtual addresses "begin" and "end". On
+  success, it returns a pointer to the lowest such region.
+*/
+void* find_unmapped_region_between(struct memory_info* mem, uint32_t size, uint32_t begin, uint32_t end) {
   const struct list_link* pages_head = &mem->pages_head;
-  struct list_link* curr = pages_head->next;
-  struct page_region* curr_data;
-  struct page_region* next_data;
-  uint32_t gap;
+  struct list_link* curr;
+  struct page_region* region;
+  uint32_t addr = begin;
 
   size = ALIGN(size, PAGE_SIZE);
 
-  while (curr->next != pages_head) {
-    curr_data = list_data(curr, struct page_region, link);
-    next_data = list_data(curr->next, struct page_region, link);
-    gap = next_data->begin - page_region_end(curr_data);
+  if (!size || begin > end || size > end - begin) {
+    return NULL;
+  }
+
+  region = find_prev_page_region(mem, begin);
+
+  if (region) {
+    if (page_region_end(region) > addr) {
+      addr = page_region_end(region);
+    }
+
+    curr = region->link.next;
+  }
+  else {
+    curr = pages_head->next;
+  }
+
+  while (addr <= end - size) {
+    region = curr != pages_head ? list_data(curr, struct page_region, link) : NULL;
+
+    if (!region || region->begin >= end || region->begin - addr >= size) {
+      return (void*)addr;
+    }
 
-    if (gap >= size) {
-      return (void*)page_region_end(curr_data);
+    if (page_region_end(region) > addr) {
+      addr = page_region_end(region);
     }
 
     curr = curr->next;
@@ -455,25 +776,292 @@ void* find_unmapped_region(struct memory_info* mem, uint32_t size) {
 }
 
 /*
-  addr_to_pmd returns the address of a page middle directory from a virtual
-  address "addr", and the base address of a page global directory "pgd". It
-  returns the address of a page table first-level descriptor from a virtual
-  address "addr", and a translation table base, "pgd".
+  is_region_unmapped returns if no part of the virtual address region
+  beginning at "begin" of size "size" is mapped in the userspace of the memory
+  context "mem".
 */
-uint32_t* addr_to_pmd(const uint32_t* pgd, uint32_t addr) {
-  return (uint32_t*)((uint32_t)pgd + pgd_index(addr));
+bool is_region_unmapped(struct memory_info* mem, uint32_t begin, uint32_t size) {
+  struct page_region* region;
+
+  if (!size || begin > USER_VADDR_END - size) {
+    return false;
+  }
+
+  region = find_prev_page_region(mem, begin + size - 1);
+
+  return !region || page_region_end(region) <= begin;
 }
 
 /*
-  addr_to_pte returns the address of a page table entry from a virtual address
-  "addr", and the base address of a page middle directory "pmd". It returns the
-  address of a small page second-level descriptor from a virtual address,
-  "addr" and a page table base address, "pmd".
+  region_map maps a region of "length" bytes into the current process's memory
+  context and returns its address. The region has the memory protection flags
+  "prot", and "flags" are the region map flags. If MAP_ANONYMOUS is set, then
+  the region is zeroed, otherwise it is backed by the file specified by the
+  file descriptor "fd" beginning at the offset "offset". A shared file region
+  maps the page cache's pages, and a private one copies them on write.
+
+  The region is placed at "addr" if it is free, and must be placed there if
+  MAP_FIXED is set, in which case anything already mapped there is unmapped.
+  On failure NULL is returned.
 */
-uint32_t* addr_to_pte(const uint32_t* pmd, uint32_t addr) {
-  pmd = pmd_to_page_table(pmd);
-  return (uint32_t*)((uint32_t)pmd + pmd_index(addr));
-}
+void* region_map(uint32_t addr, size_t length, int prot, int flags, int fd, uint32_t offset) {
+  struct memory_info* mem = current->mem;
+  struct file_info_int* file = NULL;
+  struct page_region* region;
+  size_t count;
+
+  prot &= PAGE_RWX;
+
+  /* Exactly one of MAP_SHARED and MAP_PRIVATE must be set. */
+  if (!length || length > USER_VADDR_END || !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE) || !IS_ALIGNED(offset, PAGE_SIZE)) {
+    return NULL;
+  }
+
+  count = page_count(length);
+  length = page_addr(count);
+
+  if (flags & MAP_ANONYMOUS) {
+    /*
+      Anonymous pages are only shared copy-on-write with a clone, so shared
+      anonymous regions aren't supported.
+    */
+    if (flags & MAP_SHARED) {
+      return NULL;
+    }
+  }
+  else {
+    file = fd_to_file(fd);
+
+    if (!file || file->ext.type != FT_REGULAR || !(file->ft->status & FS_READ)) {
+      return NULL;
+    }
+
+    if (flags & MAP_SHARED && prot & PAGE_WRITE && !(file->ft->status & FS_WRITE)) {
+      return NULL;
+    }
+  }
+
+  if (flags & MAP_FIXED) {
+    if (!IS_ALIGNED(addr, PAGE_SIZE) || addr < PAGE_SIZE || addr > USER_VADDR_END - length) {
+      return NULL;
+    }
+
+    region_unmap(addr, length);
+  }
+  else if (!IS_ALIGNED(addr, PAGE_SIZE) || !is_region_unmapped(mem, addr, length)) {
+    addr = (uint32_t)find_unmapped_region(mem, length);
+
+    if (!addr) {
+      return NULL;
+    }
+  }
+
+  if (file) {
+    if (flags & MAP_PRIVATE) {
+      prot |= PAGE_PRIVATE;
+    }
+    else if (file->ft->status & FS_WRITE) {
+      prot |= PAGE_MAYWRITE;
+    }
+
+    region = create_file_page_region(addr, count, prot, file);
+
+    if (region) {
+      region->file_offset = offset;
+    }
+  }
+  else {
+    region = create_anon_page_region(addr, count, prot);
+  }
+
+  if (!region) {
+    return NULL;
+  }
+
+  if (insert_page_region(mem, region) < 0) {
+    free_page_region(region);
+    return NULL;
+  }
+
+  return (void*)addr;
+}
+
+/*
+  region_unmap unmaps the region of "length" bytes beginning at the address
+  "addr" from the current process's memory context. The parts of the region
+  which aren't mapped are skipped.
+*/
+int region_unmap(uint32_t addr, size_t length) {
+  struct memory_info* mem = current->mem;
+  struct page_region* region;
+  uint32_t begin;
+  uint32_t end;
+
+  if (!length || !IS_ALIGNED(addr, PAGE_SIZE) || addr < PAGE_SIZE || length > USER_VADDR_END - addr) {
+    return -1;
+  }
+
+  end = addr + ALIGN(length, PAGE_SIZE);
+
+  /* The page regions are removed from the last one downwards. */
+  while (addr < end) {
+    region = find_prev_page_region(mem, end - 1);
+
+    if (!region || page_region_end(region) <= addr) {
+      break;
+    }
+
+    begin = region->begin > addr ? region->begin : addr;
+
+    if (page_region_end(region) < end) {
+      end = page_region_end(region);
+    }
+
+    if (remove_mapping(mem, begin, end - begin) < 0) {
+      return -1;
+    }
+
+    end = begin;
+  }
+
+  return 0;
+}
+
+/*
+  region_protect changes the memory protection flags of the region of "length"
+  bytes beginning at the address "addr" in the current process's memory
+  context to "prot". The whole region must be mapped.
+*/
+int region_protect(uint32_t addr, size_t length, int prot) {
+  struct memory_info* mem = current->mem;
+  struct page_region* region;
+  uint32_t end;
+
+  prot &= PAGE_RWX;
+
+  if (!length || !IS_ALIGNED(addr, PAGE_SIZE) || addr < PAGE_SIZE || length > USER_VADDR_END - addr) {
+    return -1;
+  }
+
+  length = ALIGN(length, PAGE_SIZE);
+  end = addr + length;
+
+  if (!is_region_mapped(mem, addr, length)) {
+    return -1;
+  }
+
+  /* Check every page region before any of them are changed. */
+  for (region = find_page_region(mem, addr); region->begin < end; region = list_data(region->link.next, struct page_region, link)) {
+    if (region->flags & PAGE_KERNEL) {
+      return -1;
+    }
+
+    /* A shared file mapping may only become writable if its file was open for writing. */
+    if (region->type == PR_FILE && !(region->flags & PAGE_PRIVATE) && prot & PAGE_WRITE && !(region->flags & PAGE_MAYWRITE)) {
+      return -1;
+    }
+  }
+
+  region = find_page_region(mem, addr);
+
+  if (region->begin < addr) {
+    region = split_page_region(mem, region, page_index(addr - region->begin));
+
+    if (!region) {
+      return -1;
+    }
+  }
+
+  while (region->begin < end) {
+    if (page_region_end(region) > end && !split_page_region(mem, region, page_index(end - region->begin))) {
+      return -1;
+    }
+
+    /* Writes made while the mapping was writable aren't lost. */
+    sync_page_region_pages(region, 0, region->count);
+
+    region->flags = (region->flags & ~PAGE_RWX) | prot;
+    protect_page_region(mem, region);
+    region = list_data(region->link.next, struct page_region, link);
+  }
+
+  return 0;
+}
+
+/*
+  protect_page_region updates the translation table entries of the present
+  pages in the page region "region" of the memory context "mem" to its memory
+  protection flags. Pages which are shared copy-on-write stay read-only, and
+  pages of a page region without access permissions are unmapped.
+*/
+void protect_page_region(struct memory_info* mem, struct page_region* region) {
+  const bool cow = region->type == PR_ANON || region->flags & PAGE_PRIVATE;
+  uint32_t v_addr;
+  uint32_t* pmd;
+  int flags;
+  struct tlb_gather tlb;
+
+  if (!region->pages) {
+    return;
+  }
+
+  tlb_gather_init(&tlb, mem);
+
+  for (size_t i = 0; i < region->count; ++i) {
+    if (!region->pages[i]) {
+      continue;
+    }
+
+    v_addr = region->begin + page_addr(i);
+    flags = region->flags;
+
+    /*
+      Pages without access permissions are unmapped, but the page region keeps
+      them so that they are mapped again when the protection allows it.
+    */
+    if (!(flags & PAGE_RWX)) {
+      pmd = addr_to_pmd(mem->pgd, v_addr);
+
+      if (is_pmd_section(pmd) && alloc_pmd_page_table(mem, pmd) < 0) {
+        continue;
+      }
+
+      pte_clear(pmd, v_addr);
+      tlb_gather_page(&tlb, v_addr);
+      continue;
+    }
+
+    if (cow && region->pages[i]->ref > 1) {
+      flags &= ~PAGE_WRITE;
+    }
+
+    map_page(mem, v_addr, page_to_phys(region->pages[i]), flags);
+    tlb_gather_page(&tlb, v_addr);
+  }
+
+  tlb_gather_finish(&tlb);
+}
+
+/*
+  addr_to_pmd returns the address of a page middle directory from a virtual
+  address "addr", and the base address of a page global directory "pgd". It
+  returns the address of a page table first-level descriptor from a virtual
+  address "addr", and a translation table base, "pgd".
+*/
+uint32_t* addr_to_pmd(const uint32_t* pgd, uint32_t addr) {
+  return (uint32_t*)((uint32_t)pgd + pgd_index(addr));
+}
+
+/*
+  addr_to_pte returns the address of a page table entry from a virtual address
+  "addr", and the base address of a page middle directory "pmd". It returns the
+  address of a small page second-level descriptor from a virtual address,
+  "addr" and a page table base address, "pmd".
+*/
+uint32_t* addr_to_pte(const uint32_t* pmd, uint32_t addr) {
+  pmd = pmd_to_page_table(pmd);
+  return (uint32_t*)((uint32_t)pmd + pmd_index(addr));
+}
 
 /*
   pmd_to_addr returns the virtual address which the page middle directory "pmd"
@@ -509,7 +1097,7 @@ void pmd_clear(uint32_t* pgd, uint32_t addr) {
   pmd = addr_to_pmd(pgd, addr);
 
   if (is_pmd_page_table(pmd)) {
-    memory_free(pmd_to_page_table(pmd));
+    page_table_free(pmd_to_page_table(pmd));
   }
 
   *pmd = 0x0;
@@ -517,13 +1105,37 @@ void pmd_clear(uint32_t* pgd, uint32_t addr) {
 
 /*
   pte_clear clears a page table entry from a virtual address "addr" in the page
-  middle directory "pmd".
+  middle directory "pmd". If the page table becomes empty, then it is freed and
+  "pmd" is cleared.
 */
 void pte_clear(uint32_t* pmd, uint32_t addr) {
+  uint32_t* page_table;
   uint32_t* pte;
+  uint16_t* count;
+
+  /* Demand paged regions may not have a page table yet. */
+  if (!is_pmd_page_table(pmd)) {
+    return;
+  }
 
+  page_table = pmd_to_page_table(pmd);
   pte = addr_to_pte(pmd, addr);
+
+  if (!*pte) {
+    return;
+  }
+
+  if (is_pte_large(*pte)) {
+    split_large_page(pmd, addr);
+  }
+
   *pte = 0x0;
+  count = page_table_count(page_table);
+
+  if (--*count == 0) {
+    *pmd = 0x0;
+    page_table_free(page_table);
+  }
 }
 
 /*
@@ -536,6 +1148,14 @@ void pmd_insert(uint32_t* pmd, uint32_t v_addr, uint64_t p_addr, int flags) {
   uint32_t* pte;
 
   pte = addr_to_pte(pmd, v_addr);
+
+  if (!*pte) {
+    ++*page_table_count(pmd_to_page_table(pmd));
+  }
+  else if (is_pte_large(*pte)) {
+    split_large_page(pmd, v_addr);
+  }
+
   *pte = create_pte(p_addr, flags);
 }
 
@@ -547,6 +1167,13 @@ bool is_pmd_page_table(const uint32_t* pmd) {
   return *pmd & 1;
 }
 
+/*
+  is_pte_large returns if the page table entry "pte" is part of a large page.
+*/
+bool is_pte_large(uint32_t pte) {
+  return (pte & 0x3) == 0x1;
+}
+
 /*
   is_pmd_section checks iif the page middle directory "pmd" is a section.
 */
@@ -567,35 +1194,31 @@ uint32_t* pmd_to_page_table(const uint32_t* pmd) {
 }
 
 /*
-  create_pgd creates a new page global directory and copies the kernel mappings
-  into it since they must remain present in all processes.
+  create_pgd creates a new empty page global directory for userspace. It only
+  covers the addresses below USER_VADDR_END, since the kernel mappings are
+  translated through TTBR1 by the initial page global directory.
 */
 uint32_t* create_pgd() {
   uint32_t* pgd;
-  uint32_t* init_pgd;
-  uint32_t pgd_virt_offset;
 
-  init_pgd = init_memory_info.pgd;
-  pgd = memory_alloc(PG_DIR_SIZE);
-  pgd_virt_offset = (uint32_t)addr_to_pmd(pgd, VIRT_OFFSET) - (uint32_t)pgd;
+  /* The size of the PGD is a power of two, so it is naturally aligned. */
+  pgd = memory_alloc(USER_PG_DIR_SIZE);
 
-  /* Zero out the userspace entries in the new PGD. */
-  memset(pgd, 0, pgd_virt_offset);
+  if (!pgd) {
+    return NULL;
+  }
 
-  /* Copy the kernelspace entries from the initial PGD into the new PGD. */
-  memcpy((void*)((uint32_t)pgd + pgd_virt_offset), (void*)((uint32_t)init_pgd + pgd_virt_offset), PG_DIR_SIZE - pgd_virt_offset);
+  memset(pgd, 0, USER_PG_DIR_SIZE);
 
   return pgd;
 }
 
 /*
-  reset_pgd resets the page global directory "pgd" by removing the userspace
-  mappings leaving the kernelspace ones. It assumes that the page global
-  directory already contains kernel mappings.
+  reset_pgd resets the userspace page global directory "pgd" by removing all
+  of its mappings.
 */
 void reset_pgd(uint32_t* pgd) {
-  /* Clear page table entries below the kernel. */
-  for (uint32_t i = 0; i < VIRT_OFFSET; i += PMD_SIZE) {
+  for (uint32_t i = 0; i < USER_VADDR_END; i += PMD_SIZE) {
     pmd_clear(pgd, i);
   }
 }
@@ -612,7 +1235,7 @@ void free_pgd(uint32_t* pgd) {
 /*
   copy_pgd creates and returns a copy of the global directory "pgd". However,
   it only copies the userspace entries from "pgd" since the kernelspace
-  mappings are always fixed.
+  mappings are translated through TTBR1.
 */
 uint32_t* copy_pgd(const uint32_t* pgd) {
   void* ret;
@@ -627,14 +1250,15 @@ uint32_t* copy_pgd(const uint32_t* pgd) {
     return NULL;
   }
 
-  for (size_t i = 0; i < VIRT_OFFSET; i += PMD_SIZE) {
+  for (size_t i = 0; i < USER_VADDR_END; i += PMD_SIZE) {
     src_pmd = addr_to_pmd(pgd, i);
     dest_pmd = addr_to_pmd(ret, i);
 
     if (is_pmd_page_table(src_pmd)) {
-      page_table = copy_page_table(src_pmd);
+      page_table = copy_page_table(pmd_to_page_table(src_pmd));
 
       if (!page_table) {
+        free_pgd(ret);
         return NULL;
       }
 
@@ -656,15 +1280,14 @@ uint32_t* copy_pgd(const uint32_t* pgd) {
 uint32_t* copy_page_table(const uint32_t* page_table) {
   uint32_t* ret;
 
-  ret = memory_alloc(PAGE_TABLE_SIZE);
+  ret = page_table_alloc();
 
   if (!ret) {
     return NULL;
   }
 
-  for (size_t i = 0; i < PMD_SIZE ; i += PAGE_SIZE) {
-    *addr_to_pte(ret, i) = *addr_to_pte(page_table, i);
-  }
+  memcpy(ret, page_table, PAGE_TABLE_SIZE);
+  *page_table_count(ret) = *page_table_count(page_table);
 
   return ret;
 }
@@ -691,6 +1314,18 @@ uint32_t create_pmd_page_table(uint32_t* page_table) {
   return ((uint32_t)virt_to_phys((uint32_t)page_table) & 0xfffffc00) | 1;
 }
 
+/*
+  create_large_pte creates a large page table entry to the physical address
+  "p_addr" with the memory flags "flags".
+*/
+uint32_t create_large_pte(uint64_t p_addr, int flags) {
+  uint32_t pte = (p_addr & 0xffff0000) | 1;
+
+  pte = set_descriptor_protection(pte, &large_pte_bits, flags);
+
+  return pte;
+}
+
 /*
   create_pte creates and returns a page table entry for a page table. The entry
   is specified by which physical address "p_addr" it maps to, and with which
@@ -712,7 +1347,8 @@ uint32_t create_pte(uint64_t p_addr, int flags) {
 int get_descriptor_protection(uint32_t d, const struct descriptor_bits* bits) {
   int flags = PAGE_READ;
 
-  if ((d & (1 << bits->ap[0])) > 0) {
+  /* Only user mappings set AP[1]. */
+  if ((d & (1 << bits->ap[1])) == 0) {
     flags |= PAGE_KERNEL;
   }
 
@@ -737,12 +1373,14 @@ uint32_t set_descriptor_protection(uint32_t d, const struct descriptor_bits* bit
     return d;
   }
 
+  /* User mappings are tagged with the ASID of their memory context. */
   if (flags & PAGE_KERNEL) {
     d |= 1 << bits->ap[0];
   }
   else {
     d |= 1 << bits->ap[0];
     d |= 1 << bits->ap[1];
+    d |= 1 << bits->ng;
   }
 
   if (!(flags & PAGE_WRITE)) {
@@ -759,36 +1397,53 @@ uint32_t set_descriptor_protection(uint32_t d, const struct descriptor_bits* bit
 /*
   create_page_region_bounds initializes the bounds of the page region list in
   the memory context "mem". It creates dummy lower and upper bound page regions
-  in the virtual address space.
+  in the virtual address space, the latter of which begins at "end".
 */
-int create_page_region_bounds(struct memory_info* mem) {
+int create_page_region_bounds(struct memory_info* mem, uint32_t end) {
   struct page_region* begin_region;
   struct page_region* end_region;
 
   begin_region = create_page_region(0, 1, 0);
-  begin_region->type = PR_ANON;
+  end_region = create_page_region(end, 0, 0);
+
+  if (!begin_region || !end_region) {
+    kmem_cache_free(&page_region_cache, begin_region);
+    kmem_cache_free(&page_region_cache, end_region);
 
-  end_region = create_page_region(VADDR_SPACE_END, 0, 0);
+    return -1;
+  }
+
+  begin_region->type = PR_ANON;
   end_region->type = PR_ANON;
 
-  if (!begin_region || !end_region) {
-    memory_free(begin_region);
-    memory_free(end_region);
+  if (insert_page_region(mem, begin_region) < 0) {
+    kmem_cache_free(&page_region_cache, begin_region);
+    kmem_cache_free(&page_region_cache, end_region);
 
     return -1;
   }
 
-  insert_page_region(mem, begin_region);
-  insert_page_region(mem, end_region);
+  if (insert_page_region(mem, end_region) < 0) {
+    kmem_cache_free(&page_region_cache, end_region);
+    return -1;
+  }
 
   return 0;
 }
 
+/*
+  page_region_ctor is the page region cache constructor. It clears the page
+  region which "ptr" points to.
+*/
+void page_region_ctor(void* ptr) {
+  memset(ptr, 0, sizeof(struct page_region));
+}
+
 /*
   create_page region allocates and returns a page region.
 */
 struct page_region* create_page_region(uint32_t begin, size_t count, int flags) {
-  struct page_region* region = memory_alloc(sizeof(struct page_region));
+  struct page_region* region = kmem_cache_alloc(&page_region_cache);
 
   if (!region) {
     return NULL;
@@ -803,6 +1458,35 @@ struct page_region* create_page_region(uint32_t begin, size_t count, int flags)
   return region;
 }
 
+/*
+  page_array_alloc allocates an array of "count" page pointers for a page
+  region with the memory protection flags "flags". The arrays of userspace page
+  regions which are larger than a page are virtually contiguous, so that large
+  mappings don't need contiguous physical memory. Kernel page regions always
+  use memory_alloc, since vmalloc creates them itself.
+*/
+struct phys_page** page_array_alloc(size_t count, int flags) {
+  const size_t size = sizeof(struct phys_page*) * count;
+
+  if (!(flags & PAGE_KERNEL) && size > PAGE_SIZE) {
+    return vmalloc(size);
+  }
+
+  return memory_alloc(size);
+}
+
+/*
+  page_array_free frees the page pointer array "pages".
+*/
+void page_array_free(struct phys_page** pages) {
+  if (is_vmalloc_addr(pages)) {
+    vfree(pages);
+  }
+  else {
+    memory_free(pages);
+  }
+}
+
 /*
   create_anon_page_region creates and returns an anonoymous page region. The
   page region begins at the virtual address "begin", spans "count" pages and
@@ -812,17 +1496,16 @@ struct page_region* create_anon_page_region(uint32_t begin, size_t count, int fl
   struct page_region* region;
   struct phys_page** pages;
 
-  region = memory_alloc(sizeof(struct page_region));
-  pages = memory_alloc(sizeof(struct phys_page*) * count);
+  region = kmem_cache_alloc(&page_region_cache);
+  pages = page_array_alloc(count, flags);
 
   if (!region || !pages) {
-    memory_free(region);
-    memory_free(pages);
+    kmem_cache_free(&page_region_cache, region);
+    page_array_free(pages);
 
     return NULL;
   }
 
-  memset(region, 0, sizeof(region));
   memset(pages, 0, sizeof(struct phys_page*) * count);
 
   region->begin = begin;
@@ -837,24 +1520,36 @@ struct page_region* create_anon_page_region(uint32_t begin, size_t count, int fl
 /*
   create_file_page_region creates and returns a file-backed page region. The
   page region begins at the virtual address "begin", spans "count" pages, has
-  the memory protection flags "flags", and is backed by the file "file".
+  the memory protection flags "flags", and is backed by the file "file". The
+  page region holds a reference to the file.
 */
 struct page_region* create_file_page_region(uint32_t begin, size_t count, int flags, struct file_info_int* file) {
   struct page_region* region;
+  struct phys_page** pages;
 
-  region = memory_alloc(sizeof(struct page_region));
+  if (!file) {
+    return NULL;
+  }
+
+  region = kmem_cache_alloc(&page_region_cache);
+  pages = page_array_alloc(count, flags);
+
+  if (!region || !pages) {
+    kmem_cache_free(&page_region_cache, region);
+    page_array_free(pages);
 
-  if (!region || !file) {
     return NULL;
   }
 
-  memset(region, 0, sizeof(region));
+  memset(pages, 0, sizeof(struct phys_page*) * count);
 
   region->begin = begin;
   region->count = count;
   region->flags = flags;
   region->type = PR_FILE;
   region->file = file;
+  region->pages = pages;
+  ++file->ref;
 
   return region;
 }
@@ -867,53 +1562,249 @@ void free_page_region(struct page_region* region) {
     return;
   }
 
+  put_page_region_pages(region, 0, region->count);
   file_put(region->file);
-  memory_free(region->pages);
-  memory_free(region);
+  page_array_free(region->pages);
+  kmem_cache_free(&page_region_cache, region);
+}
+
+/*
+  put_page_region_pages drops the references which the page region "region"
+  holds to its pages from the page index "begin" to "end". The pages of a
+  shared writable file mapping are written back first.
+*/
+void put_page_region_pages(struct page_region* region, size_t begin, size_t end) {
+  if (!region->pages) {
+    return;
+  }
+
+  sync_page_region_pages(region, begin, end);
+
+  for (size_t i = begin; i < end; ++i) {
+    if (region->pages[i]) {
+      page_put(region->pages[i]);
+      region->pages[i] = NULL;
+    }
+  }
+}
+
+/*
+  sync_page_region_pages writes the pages from the page index "begin" to "end"
+  of the page region "region" back to its file if it is a shared writable file
+  mapping. Writes through such a mapping go straight to the page cache, so each
+  page is copied into its buffer, which is marked dirty. Pages past the end of
+  the file, or which are no longer the file's cached page, are skipped.
+*/
+void sync_page_region_pages(struct page_region* region, size_t begin, size_t end) {
+  struct file_info_int* file = region->file;
+  struct phys_page* page;
+  struct buffer_info* buffer;
+  uint32_t offset;
+
+  if (region->type != PR_FILE || region->flags & PAGE_PRIVATE || !(region->flags & PAGE_WRITE) || !region->pages) {
+    return;
+  }
+
+  for (size_t i = begin; i < end; ++i) {
+    offset = region->file_offset + page_addr(i);
+
+    if (!region->pages[i] || offset >= file->ext.size) {
+      continue;
+    }
+
+    page = page_cache_find(file, offset);
+
+    if (!page) {
+      continue;
+    }
+
+    if (page == region->pages[i]) {
+      buffer = buffer_get(file_offset_to_addr(file, offset).num);
+
+      if (buffer) {
+        memcpy(buffer->data, (void*)page_to_virt(page), BLOCK_SIZE);
+        buffer_dirty(buffer);
+        buffer_put(buffer);
+      }
+    }
+
+    page_put(page);
+  }
+}
+
+/*
+  sync_page_regions writes the shared writable file mappings of the file
+  "file" in the memory context "mem" back to the file. If "file" is NULL, then
+  the mappings of every file are written back.
+*/
+void sync_page_regions(struct memory_info* mem, const struct file_info_int* file) {
+  struct list_link* curr;
+  struct page_region* region;
+
+  curr = mem->pages_head.next;
+
+  while (curr != &mem->pages_head) {
+    region = list_data(curr, struct page_region, link);
+
+    if (!file || region->file == file) {
+      sync_page_region_pages(region, 0, region->count);
+    }
+
+    curr = curr->next;
+  }
+}
+
+/*
+  trim_page_region removes the first "count" pages from the page region
+  "region" in the memory context "mem" and releases them.
+*/
+void trim_page_region(struct memory_info* mem, struct page_region* region, size_t count) {
+  put_page_region_pages(region, 0, count);
+
+  if (region->pages) {
+    memmove(region->pages, region->pages + count, sizeof(struct phys_page*) * (region->count - count));
+  }
+
+  region->begin += page_addr(count);
+  region->count -= count;
+  region->file_offset += page_addr(count);
+  update_page_region(mem, region);
+}
+
+/*
+  expand_page_region grows the page region "region" in the memory context
+  "mem" down so that it begins at "begin". The space below the page region must
+  be unmapped. It returns 0 on success.
+*/
+int expand_page_region(struct memory_info* mem, struct page_region* region, uint32_t begin) {
+  const size_t count = page_index(region->begin - begin);
+  struct phys_page** pages;
+
+  if (region->pages) {
+    pages = page_array_alloc(region->count + count, region->flags);
+
+    if (!pages) {
+      return -1;
+    }
+
+    memset(pages, 0, sizeof(struct phys_page*) * count);
+    memcpy(pages + count, region->pages, sizeof(struct phys_page*) * region->count);
+    page_array_free(region->pages);
+    region->pages = pages;
+  }
+
+  region->begin = begin;
+  region->count += count;
+  update_page_region_gap(mem, region);
+
+  return 0;
+}
+
+/*
+  expand_stack grows the stack in the memory context "mem" down to the
+  unmapped virtual address "addr" and returns its page region. The stack is
+  the page region after "addr" if it grows down. It isn't grown below the
+  memory context's stack limit or into the guard page above the page region
+  before it. The stack is grown by a whole large page where possible so that
+  deep stacks aren't grown one page at a time.
+*/
+struct page_region* expand_stack(struct memory_info* mem, uint32_t addr) {
+  struct page_region* prev;
+  struct page_region* region;
+  uint32_t limit;
+  uint32_t begin;
+
+  prev = find_prev_page_region(mem, addr);
+
+  if (!prev || prev->link.next == &mem->pages_head) {
+    return NULL;
+  }
+
+  region = list_data(prev->link.next, struct page_region, link);
+
+  if (!(region->flags & PAGE_GROWSDOWN) || region->type != PR_ANON) {
+    return NULL;
+  }
+
+  limit = page_region_end(prev) + STACK_GUARD_SIZE;
+
+  if (limit < mem->stack_limit) {
+    limit = mem->stack_limit;
+  }
+
+  if (addr < limit) {
+    return NULL;
+  }
+
+  begin = ALIGN_DOWN(addr, LARGE_PAGE_SIZE);
+
+  if (begin < limit) {
+    begin = limit;
+  }
+
+  if (expand_page_region(mem, region, begin) < 0) {
+    return NULL;
+  }
+
+  return region;
 }
 
 /*
   insert_page_region inserts a page region in the page region list with head
-  "head" while preserving a page region address ordering.
+  "head" while preserving a page region address ordering. Any page regions it
+  overlaps are replaced. The page regions which straddle its bounds are split
+  before anything is replaced, so if a split fails, then -1 is returned and
+  no mapping is lost. It returns 0 on success.
 */
-void insert_page_region(struct memory_info* mem, struct page_region* region) {
+int insert_page_region(struct memory_info* mem, struct page_region* region) {
   struct list_link* head = &mem->pages_head;
-  struct list_link* curr = head->next;
+  struct list_link* curr;
   uint32_t region_end = page_region_end(region);
   struct page_region* curr_region;
-  struct page_region* split_region;
-  uint32_t curr_end;
+
+  /* The part of a page region before the new one is kept. */
+  curr_region = find_page_region(mem, region->begin);
+
+  if (curr_region && curr_region->begin < region->begin) {
+    if (!split_page_region(mem, curr_region, page_index(region->begin) - page_index(curr_region->begin))) {
+      return -1;
+    }
+  }
+
+  /* The part of a page region after the new one is kept. */
+  curr_region = find_page_region(mem, region_end);
+
+  if (curr_region && curr_region->begin < region_end) {
+    if (!split_page_region(mem, curr_region, page_index(region_end) - page_index(curr_region->begin))) {
+      return -1;
+    }
+  }
+
+  /* Start from the last page region which begins before the new one. */
+  curr_region = find_prev_page_region(mem, region->begin);
+  curr = curr_region ? &curr_region->link : head->next;
 
   while(curr != head) {
     curr_region = list_data(curr, struct page_region, link);
-    curr_end = page_region_end(curr_region);
 
     if (region_end <= curr_region->begin) {
       break;
     }
 
-    if (region->begin >= curr_end) {
-      curr = curr->next;
-      continue;
-    }
-
-    if (region->begin > curr_region->begin && region->begin < curr_end) {
-      split_region = split_page_region(curr_region, page_index(region->begin) - page_index(curr_region->begin));
-      curr_region = split_region;
-      curr = &curr_region->link;
-    }
+    curr = curr->next;
 
-    if (region_end <= curr_end && region_end > curr_region->begin) {
-      split_region = split_page_region(curr_region, page_index(region_end) - page_index(curr_region->begin));
-      memory_free(split_region);
+    if (region->begin >= page_region_end(curr_region)) {
+      continue;
     }
 
-    list_remove(head, curr);
-    memory_free(curr_region);
-    curr = curr->next;
+    unlink_page_region(mem, curr_region);
+    free_page_region(curr_region);
   }
 
   list_push(curr->prev, &region->link);
+  link_page_region(mem, region);
+
+  return 0;
 }
 
 /*
@@ -921,20 +1812,139 @@ void insert_page_region(struct memory_info* mem, struct page_region* region) {
   in the memory context "mem".
 */
 void remove_page_region(struct memory_info* mem, struct page_region* region) {
-  struct list_link* head;
+  unlink_page_region(mem, region);
+  free_page_region(region);
+}
+
+/*
+  link_page_region links the page region "region", which is already in the
+  page region list of the memory context "mem", into its page region tree. The
+  tree keeps the list's ordering, so "region" is linked between its neighbours
+  in the list.
+*/
+void link_page_region(struct memory_info* mem, struct page_region* region) {
+  const struct list_link* head = &mem->pages_head;
+  struct page_region* prev = NULL;
+  struct page_region* next = NULL;
+
+  if (region->link.prev != head) {
+    prev = list_data(region->link.prev, struct page_region, link);
+  }
+
+  if (region->link.next != head) {
+    next = list_data(region->link.next, struct page_region, link);
+  }
+
+  /*
+    If the previous page region has a right subtree, then the next page region
+    is the leftmost node in it, so it has no left child.
+  */
+  if (prev && !prev->node.right) {
+    tree_link(&region->node, &prev->node, &prev->node.right);
+  }
+  else if (next) {
+    tree_link(&region->node, &next->node, &next->node.left);
+  }
+  else {
+    tree_link(&region->node, NULL, &mem->pages_root.node);
+  }
+
+  region->gap = 0;
+  region->max_gap = 0;
+  tree_insert(&mem->pages_root, &region->node, page_region_update);
+  update_page_region(mem, region);
+}
+
+/*
+  unlink_page_region unlinks the page region "region" from both the page region
+  list and tree of the memory context "mem".
+*/
+void unlink_page_region(struct memory_info* mem, struct page_region* region) {
+  struct list_link* head = &mem->pages_head;
+  struct list_link* next = region->link.next;
 
-  head = &mem->pages_head;
   list_remove(head, &region->link);
-  memory_free(region);
+  tree_remove(&mem->pages_root, &region->node, page_region_update);
+
+  if (next != head) {
+    update_page_region_gap(mem, list_data(next, struct page_region, link));
+  }
+}
+
+/*
+  update_page_region updates the gaps around the page region "region" in the
+  memory context "mem". It must be called after "region" is resized.
+*/
+void update_page_region(struct memory_info* mem, struct page_region* region) {
+  update_page_region_gap(mem, region);
+
+  if (region->link.next != &mem->pages_head) {
+    update_page_region_gap(mem, list_data(region->link.next, struct page_region, link));
+  }
+}
+
+/*
+  update_page_region_gap updates the gap before the page region "region" in the
+  memory context "mem" and the largest gaps of its ancestors.
+*/
+void update_page_region_gap(struct memory_info* mem, struct page_region* region) {
+  struct page_region* prev;
+  uint32_t begin;
+  uint32_t end;
+
+  if (region->link.prev != &mem->pages_head) {
+    prev = list_data(region->link.prev, struct page_region, link);
+    begin = page_region_end(prev);
+    end = region->begin;
+
+    /* The space which a stack can grow down into isn't free. */
+    if (region->flags & PAGE_GROWSDOWN && end > mem->stack_limit - STACK_GUARD_SIZE) {
+      end = mem->stack_limit - STACK_GUARD_SIZE;
+    }
+
+    region->gap = end > begin ? end - begin : 0;
+  }
+  else {
+    region->gap = 0;
+  }
+
+  tree_propagate(&region->node, page_region_update);
+}
+
+/*
+  page_region_update is the page region tree update function. It computes the
+  largest gap in the subtree of the page region whose tree node is "node".
+*/
+void page_region_update(struct tree_node* node) {
+  struct page_region* region = tree_data(node, struct page_region, node);
+  struct page_region* child;
+
+  region->max_gap = region->gap;
+
+  if (node->left) {
+    child = tree_data(node->left, struct page_region, node);
+
+    if (child->max_gap > region->max_gap) {
+      region->max_gap = child->max_gap;
+    }
+  }
+
+  if (node->right) {
+    child = tree_data(node->right, struct page_region, node);
+
+    if (child->max_gap > region->max_gap) {
+      region->max_gap = child->max_gap;
+    }
+  }
 }
 
 /*
   split_page_region splits the page region "region" at the page index "index"
   into two page regions, a left one and a right one. The left one is just the
-  original region resized and the right one is allocated. On success, the right
-  page region is returned.
+  original region resized and the right one is allocated and inserted into the
+  memory context "mem". On success, the right page region is returned.
 */
-struct page_region* split_page_region(struct page_region* region, size_t index) {
+struct page_region* split_page_region(struct memory_info* mem, struct page_region* region, size_t index) {
   const size_t region_count = region->count;
   struct page_region* insert_region;
 
@@ -946,21 +1956,40 @@ struct page_region* split_page_region(struct page_region* region, size_t index)
     return region;
   }
 
-  region->count = index;
-
-  insert_region = memory_alloc(sizeof(struct page_region));
+  insert_region = kmem_cache_alloc(&page_region_cache);
 
   if (!insert_region) {
     return NULL;
   }
 
+  /* The right page region takes the pages after the split. */
+  if (region->pages) {
+    insert_region->pages = page_array_alloc(region_count - index, region->flags);
+
+    if (!insert_region->pages) {
+      kmem_cache_free(&page_region_cache, insert_region);
+      return NULL;
+    }
+
+    memcpy(insert_region->pages, region->pages + index, sizeof(struct phys_page*) * (region_count - index));
+  }
+
+  region->count = index;
+
   insert_region->begin = page_region_end(region);
   insert_region->count = region_count - index;
   insert_region->flags = region->flags;
+  insert_region->type = region->type;
   insert_region->file = region->file;
+
+  if (insert_region->file) {
+    ++insert_region->file->ref;
+  }
+
   insert_region->file_offset = region->file_offset + (index << PAGE_SHIFT);
 
   list_push(&region->link, &insert_region->link);
+  link_page_region(mem, insert_region);
 
   return insert_region;
 }
@@ -970,25 +1999,42 @@ struct page_region* split_page_region(struct page_region* region, size_t index)
   inside. If "addr" is inside no page region, then NULL is returned.
 */
 struct page_region* find_page_region(struct memory_info* mem, uint32_t addr) {
-  struct list_link* pages_head = &mem->pages_head;
-  struct list_link* curr = pages_head->next;
   struct page_region* region;
-  uint32_t region_end;
 
-  while (curr != pages_head) {
-    region = list_data(curr, struct page_region, link);
-    region_end = page_region_end(region);
-
-    if (addr >= region->begin && addr < region_end) {
-      return region;
-    }
+  region = find_prev_page_region(mem, addr);
 
-    curr = curr->next;
+  if (region && addr < page_region_end(region)) {
+    return region;
   }
 
   return NULL;
 }
 
+/*
+  find_prev_page_region returns the last page region in the memory context
+  "mem" which begins at or before the virtual address "addr". If there is no
+  such page region, then NULL is returned.
+*/
+struct page_region* find_prev_page_region(struct memory_info* mem, uint32_t addr) {
+  struct tree_node* node = mem->pages_root.node;
+  struct page_region* region;
+  struct page_region* ret = NULL;
+
+  while (node) {
+    region = tree_data(node, struct page_region, node);
+
+    if (addr < region->begin) {
+      node = node->left;
+    }
+    else {
+      ret = region;
+      node = node->right;
+    }
+  }
+
+  return ret;
+}
+
 /*
   find_end_contig_page_region returns the last contiguous page region relative
   to the starting page region "begin" in the memory context specified by "mem".
@@ -1014,31 +2060,104 @@ struct page_region* find_end_contig_page_region(struct memory_info* mem, struct
 }
 
 /*
-  copy_page_region copies the page regions from "src" into "dest". It returns
-  the number of page regions copied.
+  copy_page_region copies the page regions from "src" into "dest". The pages of
+  the page regions are shared and mapped into "dest". Private writable pages
+  are mapped read-only in both "src" and "dest" so that they are copied on
+  write. It returns 0 on success, and -1 if anything couldn't be copied, in
+  which case "dest" only holds part of "src" and should be freed.
 */
-size_t copy_page_regions(struct memory_info* dest, const struct memory_info* src) {
-  size_t ret;
+int copy_page_regions(struct memory_info* dest, struct memory_info* src) {
+  int ret = 0;
   const struct list_link* src_head;
   struct page_region* src_region;
   struct page_region* dest_region;
   struct list_link* curr;
+  uint32_t v_addr;
+  uint64_t p_addr;
+  int flags;
+  struct tlb_gather tlb;
 
+  tlb_gather_init(&tlb, src);
   src_head = &src->pages_head;
   curr = src_head->next;
 
   while (curr != src_head) {
     src_region = list_data(curr, struct page_region, link);
 
-    dest_region = memory_alloc(sizeof(struct page_region));
+    /*
+      Kernel page regions, such as vmalloc allocations in the kernel's memory
+      context, are shared through TTBR1 and aren't copied.
+    */
+    if (src_region->flags & PAGE_KERNEL || src_region->begin >= USER_VADDR_END) {
+      curr = curr->next;
+      continue;
+    }
+
+    dest_region = kmem_cache_alloc(&page_region_cache);
+
+    if (!dest_region) {
+      ret = -1;
+      break;
+    }
+
     *dest_region = *src_region;
 
-    insert_page_region(dest, dest_region);
+    if (src_region->pages) {
+      dest_region->pages = page_array_alloc(src_region->count, src_region->flags);
+
+      if (!dest_region->pages) {
+        kmem_cache_free(&page_region_cache, dest_region);
+        ret = -1;
+        break;
+      }
+
+      memset(dest_region->pages, 0, sizeof(struct phys_page*) * src_region->count);
+      flags = src_region->flags;
+
+      /* Anonymous pages and private file pages are copied on write. */
+      if (src_region->type == PR_ANON || src_region->flags & PAGE_PRIVATE) {
+        flags &= ~PAGE_WRITE;
+      }
+
+      for (size_t i = 0; i < src_region->count; ++i) {
+        if (!src_region->pages[i]) {
+          continue;
+        }
+
+        v_addr = src_region->begin + page_addr(i);
+        p_addr = page_to_phys(src_region->pages[i]);
+
+        if (!map_page(dest, v_addr, p_addr, flags)) {
+          ret = -1;
+          break;
+        }
+
+        if (flags != src_region->flags) {
+          map_page(src, v_addr, p_addr, flags);
+          tlb_gather_page(&tlb, v_addr);
+        }
+
+        page_get(src_region->pages[i]);
+        dest_region->pages[i] = src_region->pages[i];
+      }
+    }
+
+    /* The page region holds its own reference to its file. */
+    if (dest_region->file) {
+      ++dest_region->file->ref;
+    }
+
+    if (ret < 0 || insert_page_region(dest, dest_region) < 0) {
+      free_page_region(dest_region);
+      ret = -1;
+      break;
+    }
 
     curr = curr->next;
-    ++ret;
   }
 
+  tlb_gather_finish(&tlb);
+
   return ret;
 }
 
@@ -1054,12 +2173,10 @@ void free_page_regions(struct memory_info* mem) {
   while (curr != pages_head) {
     region = list_data(curr, struct page_region, link);
 
-    if (region->file) {
-      file_put(region->file);
-    }
-
     list_remove(pages_head, curr);
     curr = curr->next;
     free_page_region(region);
   }
+
+  mem->pages_root.node = NULL;
 }
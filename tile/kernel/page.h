@@ -3,6 +3,8 @@
 
 #include <kernel/list.h>
 #include <kernel/process.h>
+#include <kernel/slab.h>
+#include <kernel/tree.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,10 +17,14 @@
 #define page_region_end(region) (region->begin + PAGE_SIZE * region->count)
 #define page_region_size(region) (region->count * PAGE_SIZE)
 
+#define TLB_GATHER_MAX_PAGES 64
+
 /*
   struct page_region represents a region of virtual pages. It differs from a
   struct page group as the pages it tracks are sparse not individual pages
-  themselves.
+  themselves. Page regions are both in an address ordered list and a tree.
+  "gap" is the size of the unmapped space between the page region and the one
+  before it, and "max_gap" is the largest "gap" in its subtree.
 */
 struct page_region {
   uint32_t begin;
@@ -28,17 +34,25 @@ struct page_region {
   struct file_info_int* file;
   struct phys_page** pages;
   uint32_t file_offset;
+  uint32_t gap;
+  uint32_t max_gap;
   struct list_link link;
+  struct tree_node node;
 };
 
 /*
   enum page_region_flags represents the attributes of a virtual page region.
+  PAGE_MAYWRITE marks a shared file page region whose file was open for
+  writing when it was mapped, so that it may be made writable.
 */
 enum page_region_flags {
   PAGE_READ = 0x1,
   PAGE_WRITE = 0x2,
   PAGE_EXECUTE = 0x4,
-  PAGE_KERNEL = 0x8
+  PAGE_KERNEL = 0x8,
+  PAGE_PRIVATE = 0x10,
+  PAGE_GROWSDOWN = 0x20,
+  PAGE_MAYWRITE = 0x40
 };
 
 /*
@@ -50,26 +64,70 @@ enum page_region_type {
   PR_FILE,
 };
 
+/*
+  enum region_map_flags represents the flags which can be passed when mapping a
+  region. They are the same as the Linux ones.
+*/
+enum region_map_flags {
+  MAP_SHARED = 0x01,
+  MAP_PRIVATE = 0x02,
+  MAP_FIXED = 0x10,
+  MAP_ANONYMOUS = 0x20
+};
+
 /*
   struct descriptor_bits represents the bit indexes of certain descriptor
-  protection bits. "ap" are the access permissions bits, and "xn" is the
-  execute-never bit.
+  protection bits. "ap" are the access permissions bits, "xn" is the
+  execute-never bit, and "ng" is the not-global bit.
 */
 struct descriptor_bits {
   uint8_t ap[3];
   uint8_t xn;
+  uint8_t ng;
+};
+
+/*
+  struct tlb_gather represents a batch of TLB invalidations in the memory
+  context "mem". The invalidated pages are bounded by "begin" and the last page
+  "last", and "count" is the number of pages which were gathered.
+*/
+struct tlb_gather {
+  struct memory_info* mem;
+  uint32_t begin;
+  uint32_t last;
+  size_t count;
 };
 
+extern struct kmem_cache page_region_cache;
+
+extern uint32_t asid_generation;
+extern uint32_t next_asid;
+
 const extern uint32_t* vector_table_begin;
 const extern uint32_t* vector_table_end;
 
 extern void flush_pgd();
 extern void flush_pte(uint32_t v_addr);
-extern void set_pgd(uint32_t pgd);
+extern void flush_pte_asid(uint32_t mva);
+extern void flush_asid(uint32_t asid);
+extern void invalidate_pte(uint32_t v_addr);
+extern void invalidate_pte_asid(uint32_t mva);
+extern void sync_tlb();
+extern void set_context(uint32_t pgd, uint32_t asid);
 
 void init_paging();
 void init_pgd();
 
+void asid_alloc(struct memory_info* mem);
+void switch_memory_info(struct memory_info* mem);
+void flush_page(struct memory_info* mem, uint32_t v_addr);
+bool is_asid_stale(const struct memory_info* mem);
+
+void tlb_gather_init(struct tlb_gather* tlb, struct memory_info* mem);
+void tlb_gather_page(struct tlb_gather* tlb, uint32_t v_addr);
+void tlb_gather_range(struct tlb_gather* tlb, uint32_t v_addr, uint32_t size);
+void tlb_gather_finish(struct tlb_gather* tlb);
+
 void map_kernel();
 void map_peripherals();
 void map_vector_table();
@@ -79,9 +137,21 @@ void* create_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr,
 int remove_mapping(struct memory_info* mem, uint32_t v_addr, uint32_t size);
 void* create_section_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, uint32_t size, int flags);
 void* create_page_mapping(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, uint32_t size, int flags);
+void* map_page(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, int flags);
+void* map_large_page(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, int flags);
+void* map_block(struct memory_info* mem, uint32_t v_addr, uint64_t p_addr, uint32_t size, int flags);
+int alloc_pmd_page_table(struct memory_info* mem, uint32_t* pmd);
+void split_large_page(uint32_t* pmd, uint32_t v_addr);
 void remap_section(struct memory_info* mem, uint32_t* pmd, uint32_t pmd_page_table);
 bool is_region_mapped(struct memory_info* mem, uint32_t begin, uint32_t size);
 void* find_unmapped_region(struct memory_info* mem, uint32_t size);
+void* find_unmapped_region_between(struct memory_info* mem, uint32_t size, uint32_t begin, uint32_t end);
+bool is_region_unmapped(struct memory_info* mem, uint32_t begin, uint32_t size);
+
+void* region_map(uint32_t addr, size_t length, int prot, int flags, int fd, uint32_t offset);
+int region_unmap(uint32_t addr, size_t length);
+int region_protect(uint32_t addr, size_t length, int prot);
+void protect_page_region(struct memory_info* mem, struct page_region* region);
 
 uint32_t* addr_to_pmd(const uint32_t* pgd, uint32_t addr);
 uint32_t* addr_to_pte(const uint32_t* pmd, uint32_t addr);
@@ -93,6 +163,7 @@ void pmd_clear(uint32_t* pgd, uint32_t addr);
 void pte_clear(uint32_t* pmd, uint32_t addr);
 void pmd_insert(uint32_t* pmd, uint32_t v_addr, uint64_t p_addr, int flags);
 
+bool is_pte_large(uint32_t pte);
 bool is_pmd_page_table(const uint32_t* pmd);
 bool is_pmd_section(const uint32_t* pmd);
 uint32_t* pmd_to_page_table(const uint32_t* pmd);
@@ -104,21 +175,37 @@ uint32_t* copy_pgd(const uint32_t* pgd);
 uint32_t* copy_page_table(const uint32_t* page_table);
 uint32_t create_pmd_section(uint64_t p_addr, int flags);
 uint32_t create_pmd_page_table(uint32_t* page_table);
+uint32_t create_large_pte(uint64_t p_addr, int flags);
 uint32_t create_pte(uint64_t p_addr, int flags);
 int get_descriptor_protection(uint32_t d, const struct descriptor_bits* bits);
 uint32_t set_descriptor_protection(uint32_t d, const struct descriptor_bits* bits, int flags);
 
-int create_page_region_bounds(struct memory_info* mem);
+int create_page_region_bounds(struct memory_info* mem, uint32_t end);
+void page_region_ctor(void* ptr);
 struct page_region* create_page_region(uint32_t begin, size_t count, int flags);
+struct phys_page** page_array_alloc(size_t count, int flags);
+void page_array_free(struct phys_page** pages);
 struct page_region* create_anon_page_region();
 struct page_region* create_file_page_region();
 void free_page_region(struct page_region* region);
-void insert_page_region(struct memory_info* mem, struct page_region* region);
+void put_page_region_pages(struct page_region* region, size_t begin, size_t end);
+void sync_page_region_pages(struct page_region* region, size_t begin, size_t end);
+void sync_page_regions(struct memory_info* mem, const struct file_info_int* file);
+void trim_page_region(struct memory_info* mem, struct page_region* region, size_t count);
+int expand_page_region(struct memory_info* mem, struct page_region* region, uint32_t begin);
+struct page_region* expand_stack(struct memory_info* mem, uint32_t addr);
+int insert_page_region(struct memory_info* mem, struct page_region* region);
 void remove_page_region(struct memory_info* mem, struct page_region* region);
-struct page_region* split_page_region(struct page_region* region, size_t index);
+void link_page_region(struct memory_info* mem, struct page_region* region);
+void unlink_page_region(struct memory_info* mem, struct page_region* region);
+void update_page_region(struct memory_info* mem, struct page_region* region);
+void update_page_region_gap(struct memory_info* mem, struct page_region* region);
+void page_region_update(struct tree_node* node);
+struct page_region* split_page_region(struct memory_info* mem, struct page_region* region, size_t index);
 struct page_region* find_page_region(struct memory_info* mem, uint32_t addr);
+struct page_region* find_prev_page_region(struct memory_info* mem, uint32_t addr);
 struct page_region* find_end_contig_page_region(struct memory_info* mem, struct page_region* begin);
-size_t copy_page_regions(struct memory_info* dest, const struct memory_info* src);
+int copy_page_regions(struct memory_info* dest, struct memory_info* src);
 void free_page_regions(struct memory_info* mem);
 
 #endif
@@ -0,0 +1,343 @@
+/*
+  page_cache.c handles the page cache.
+
+  The page cache maps file pages to the physical pages which hold them, so
+  that every process which maps the same page of a file shares one physical
+  page. Entries are keyed by the file's information number and the page's
+  offset in the file, and are hashed into a fixed number of buckets.
+
+  A page is read from the filesystem directly into the cached page, unless its
+  block is in the buffer cache, in which case it is copied from there. The
+  cache holds its own reference to each page, and pages which are referenced
+  by nothing else are reclaimed when an address space is torn down or when
+  the page allocator runs out of free blocks.
+
+  Writes to a file are copied into its cached pages, and truncating a file or
+  reusing its information number drops the pages which no longer belong to
+  it.
+*/
+
+#include <kernel/page_cache.h>
+#include <kernel/buffer.h>
+#include <lib/string.h>
+
+struct list_link page_cache_heads[PAGE_CACHE_SIZE];
+
+struct kmem_cache page_cache_entry_cache = KMEM_CACHE_INIT(page_cache_entry_cache, "page_cache_entry", sizeof(struct page_cache_entry), 0, NULL);
+
+/*
+  page_cache_init initializes the page cache's hash buckets.
+*/
+void page_cache_init() {
+  for (size_t i = 0; i < PAGE_CACHE_SIZE; ++i) {
+    list_init(&page_cache_heads[i]);
+  }
+}
+
+/*
+  page_cache_find returns the physical page which holds the page at the offset
+  "offset" in the file "file" and takes a reference to it for the caller. If
+  the page isn't cached, then NULL is returned.
+*/
+struct phys_page* page_cache_find(struct file_info_int* file, uint32_t offset) {
+  const uint32_t num = file->ext.num;
+  struct list_link* head;
+  struct list_link* curr;
+  struct page_cache_entry* entry;
+
+  offset = ALIGN_DOWN(offset, PAGE_SIZE);
+  head = &page_cache_heads[page_cache_hash(num, offset)];
+  curr = head->next;
+
+  while (curr != head) {
+    entry = list_data(curr, struct page_cache_entry, link);
+
+    if (entry->num == num && entry->offset == offset) {
+      page_get(entry->page);
+      return entry->page;
+    }
+
+    curr = curr->next;
+  }
+
+  return NULL;
+}
+
+/*
+  page_cache_get returns the physical page which holds the page at the offset
+  "offset" in the file "file" and takes a reference to it for the caller. If
+  the page isn't cached, then it is read and added to the page cache. On
+  failure NULL is returned.
+*/
+struct phys_page* page_cache_get(struct file_info_int* file, uint32_t offset) {
+  struct phys_page* page;
+
+  page = page_cache_find(file, offset);
+
+  if (page) {
+    return page;
+  }
+
+  page = pages_alloc(1, ZONE_LOWMEM);
+
+  if (!page) {
+    return NULL;
+  }
+
+  if (page_cache_add(file, offset, page) < 0) {
+    page_put(page);
+    return NULL;
+  }
+
+  /* The page cache holds the first reference and the caller the second. */
+  page_get(page);
+
+  return page;
+}
+
+/*
+  page_cache_add reads the page at the offset "offset" in the file "file" into
+  the physical page "page" and adds it to the page cache. The page cache takes
+  over the caller's reference to "page" on success.
+*/
+int page_cache_add(struct file_info_int* file, uint32_t offset, struct phys_page* page) {
+  struct filesystem_addr fs_addr;
+  struct buffer_info* buffer;
+
+  offset = ALIGN_DOWN(offset, PAGE_SIZE);
+  fs_addr = file_offset_to_addr(file, offset);
+  buffer = buffer_find(fs_addr.num);
+
+  if (buffer && buffer->status & BS_UPTODATE) {
+    memcpy((void*)page_to_virt(page), buffer->data, BLOCK_SIZE);
+  }
+  else if (buffer_read(fs_addr.num, (char*)page_to_virt(page)) < 0) {
+    return -1;
+  }
+
+  return page_cache_insert(file, offset, page);
+}
+
+/*
+  page_cache_insert adds the physical page "page", which already holds the
+  page at the offset "offset" in the file "file", to the page cache. The page
+  cache takes over the caller's reference to "page" on success.
+*/
+int page_cache_insert(struct file_info_int* file, uint32_t offset, struct phys_page* page) {
+  struct page_cache_entry* entry;
+
+  entry = kmem_cache_alloc(&page_cache_entry_cache);
+
+  if (!entry) {
+    return -1;
+  }
+
+  entry->num = file->ext.num;
+  entry->offset = ALIGN_DOWN(offset, PAGE_SIZE);
+  entry->page = page;
+  list_push(&page_cache_heads[page_cache_hash(entry->num, entry->offset)], &entry->link);
+
+  return 0;
+}
+
+/*
+  page_cache_read_block reads the LARGE_PAGE_SIZE block of pages at the offset
+  "offset" in the file "file" into one naturally aligned block of physical
+  pages, so that they can be mapped with a large page. None of the pages may
+  be cached already, and the block must be inside the file. It returns 0 on
+  success.
+*/
+int page_cache_read_block(struct file_info_int* file, uint32_t offset) {
+  struct phys_page* page;
+  struct buffer_info* buffer;
+  uint32_t num;
+  size_t count;
+
+  if (!IS_ALIGNED(offset, LARGE_PAGE_SIZE) || offset + LARGE_PAGE_SIZE > ALIGN(file->ext.size, PAGE_SIZE)) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < PAGES_PER_LARGE_PAGE; ++i) {
+    page = page_cache_find(file, offset + page_addr(i));
+
+    if (page) {
+      page_put(page);
+      return -1;
+    }
+  }
+
+  page = pages_alloc(PAGES_PER_LARGE_PAGE, ZONE_LOWMEM);
+
+  if (!page) {
+    return -1;
+  }
+
+  pages_split(page, PAGES_PER_LARGE_PAGE);
+
+  /*
+    The pages are physically contiguous, so each run of contiguous filesystem
+    blocks which aren't in the buffer cache is read with one transfer.
+  */
+  for (size_t i = 0; i < PAGES_PER_LARGE_PAGE; i += count) {
+    num = file_offset_to_addr(file, offset + page_addr(i)).num;
+    buffer = buffer_find(num);
+    count = 1;
+
+    if (buffer && buffer->status & BS_UPTODATE) {
+      memcpy((void*)page_to_virt(page + i), buffer->data, BLOCK_SIZE);
+      continue;
+    }
+
+    while (i + count < PAGES_PER_LARGE_PAGE && file_offset_to_addr(file, offset + page_addr(i + count)).num == num + count && !buffer_find(num + count)) {
+      ++count;
+    }
+
+    if (buffer_read_blocks(num, (char*)page_to_virt(page + i), count) < 0) {
+      for (size_t j = 0; j < PAGES_PER_LARGE_PAGE; ++j) {
+        page_put(page + j);
+      }
+
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < PAGES_PER_LARGE_PAGE; ++i) {
+    if (page_cache_insert(file, offset + page_addr(i), page + i) < 0) {
+      for (; i < PAGES_PER_LARGE_PAGE; ++i) {
+        page_put(page + i);
+      }
+
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+  page_cache_read_ahead reads the "count" pages beginning at the offset
+  "offset" in the file "file" into the page cache, so that later faults on them
+  find them cached. Pages past the end of the file aren't read. Aligned blocks
+  of uncached pages are read with page_cache_read_block. It returns the number
+  of pages which are cached.
+*/
+size_t page_cache_read_ahead(struct file_info_int* file, uint32_t offset, size_t count) {
+  size_t ret = 0;
+  struct phys_page* page;
+
+  offset = ALIGN_DOWN(offset, PAGE_SIZE);
+
+  while (ret < count && offset < file->ext.size) {
+    if (count - ret >= PAGES_PER_LARGE_PAGE && !page_cache_read_block(file, offset)) {
+      ret += PAGES_PER_LARGE_PAGE;
+      offset += LARGE_PAGE_SIZE;
+      continue;
+    }
+
+    page = page_cache_get(file, offset);
+
+    if (!page) {
+      break;
+    }
+
+    /* Only the page cache's reference is kept. */
+    page_put(page);
+    ++ret;
+    offset += PAGE_SIZE;
+  }
+
+  return ret;
+}
+
+/*
+  page_cache_update copies the "count" bytes "data" which were written at the
+  offset "offset" in the file "file" into the cached pages which hold them, so
+  that the page cache stays coherent with file writes. Only the written range
+  is copied, so stores made through shared mappings of the same pages to the
+  rest of them are kept.
+*/
+void page_cache_update(struct file_info_int* file, uint32_t offset, const char* data, size_t count) {
+  struct phys_page* page;
+  size_t n;
+
+  while (count) {
+    n = PAGE_SIZE - offset % PAGE_SIZE;
+
+    if (n > count) {
+      n = count;
+    }
+
+    page = page_cache_find(file, offset);
+
+    if (page) {
+      memcpy((char*)page_to_virt(page) + offset % PAGE_SIZE, data, n);
+      page_put(page);
+    }
+
+    offset += n;
+    data += n;
+    count -= n;
+  }
+}
+
+/*
+  page_cache_invalidate removes the cached pages of the file "file" which are
+  at or after the offset "offset". Pages which are still mapped stay with their
+  mappings, but later lookups read the file again. It returns the number of
+  pages which were removed.
+*/
+size_t page_cache_invalidate(const struct file_info_int* file, uint32_t offset) {
+  size_t ret = 0;
+  struct list_link* curr;
+  struct page_cache_entry* entry;
+
+  for (size_t i = 0; i < PAGE_CACHE_SIZE; ++i) {
+    curr = page_cache_heads[i].next;
+
+    while (curr != &page_cache_heads[i]) {
+      entry = list_data(curr, struct page_cache_entry, link);
+      curr = curr->next;
+
+      if (entry->num != file->ext.num || entry->offset < offset) {
+        continue;
+      }
+
+      list_remove(&page_cache_heads[i], &entry->link);
+      page_put(entry->page);
+      kmem_cache_free(&page_cache_entry_cache, entry);
+      ++ret;
+    }
+  }
+
+  return ret;
+}
+
+/*
+  page_cache_reclaim removes the pages which are only referenced by the page
+  cache and returns the number of pages which were removed.
+*/
+size_t page_cache_reclaim() {
+  size_t ret = 0;
+  struct list_link* curr;
+  struct page_cache_entry* entry;
+
+  for (size_t i = 0; i < PAGE_CACHE_SIZE; ++i) {
+    curr = page_cache_heads[i].next;
+
+    while (curr != &page_cache_heads[i]) {
+      entry = list_data(curr, struct page_cache_entry, link);
+      curr = curr->next;
+
+      if (entry->page->ref > 1) {
+        continue;
+      }
+
+      list_remove(&page_cache_heads[i], &entry->link);
+      page_put(entry->page);
+      kmem_cache_free(&page_cache_entry_cache, entry);
+      ++ret;
+    }
+  }
+
+  return ret;
+}
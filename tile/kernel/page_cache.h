@@ -0,0 +1,46 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <kernel/file.h>
+#include <kernel/list.h>
+#include <kernel/memory.h>
+#include <kernel/slab.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_CACHE_SIZE 64
+
+#define page_cache_hash(num, offset) (((num) * 31 + page_index(offset)) % PAGE_CACHE_SIZE)
+
+/*
+  struct page_cache_entry represents a cached file page. It maps the page at
+  the offset "offset" in the file with the file information number "num" to
+  its physical page "page".
+*/
+struct page_cache_entry {
+  uint32_t num;
+  uint32_t offset;
+  struct phys_page* page;
+  struct list_link link;
+};
+
+/*
+  "page_cache_heads" are the head nodes of the page cache's hash buckets.
+*/
+extern struct list_link page_cache_heads[PAGE_CACHE_SIZE];
+
+extern struct kmem_cache page_cache_entry_cache;
+
+void page_cache_init();
+
+struct phys_page* page_cache_find(struct file_info_int* file, uint32_t offset);
+struct phys_page* page_cache_get(struct file_info_int* file, uint32_t offset);
+int page_cache_add(struct file_info_int* file, uint32_t offset, struct phys_page* page);
+int page_cache_insert(struct file_info_int* file, uint32_t offset, struct phys_page* page);
+int page_cache_read_block(struct file_info_int* file, uint32_t offset);
+size_t page_cache_read_ahead(struct file_info_int* file, uint32_t offset, size_t count);
+void page_cache_update(struct file_info_int* file, uint32_t offset, const char* data, size_t count);
+size_t page_cache_invalidate(const struct file_info_int* file, uint32_t offset);
+size_t page_cache_reclaim();
+
+#endif
@@ -0,0 +1,162 @@
+/*
+  page_table.c handles the allocation of second level page tables.
+
+  A second level page table is only PAGE_TABLE_SIZE bytes, so several of them
+  are carved out of a page table page. Because a page table page is naturally
+  aligned, its header is found by aligning a page table's address down to the
+  page table page size. The header also tracks the number of valid entries in
+  each page table, so that a page table can be freed as soon as it is empty
+  without scanning it.
+
+  Freed page tables are kept zeroed in a small cache, so that mapping heavy
+  workloads can get a page table without going through the page table pages
+  or clearing it.
+*/
+
+#include <kernel/page_table.h>
+#include <lib/string.h>
+
+struct list_link page_table_pages_head = LIST_INIT(page_table_pages_head);
+
+uint32_t* page_table_cache[PAGE_TABLE_CACHE_SIZE];
+size_t page_table_cache_size = 0;
+
+struct page_table_stats page_table_stats;
+
+/*
+  page_table_alloc allocates an empty page table and returns a pointer to it.
+  The page table is taken from the page table cache if possible.
+*/
+uint32_t* page_table_alloc() {
+  struct page_table_page* page;
+  uint32_t* ret;
+  size_t slot;
+
+  ++page_table_stats.tables;
+
+  if (page_table_cache_size) {
+    ++page_table_stats.cache_hits;
+    return page_table_cache[--page_table_cache_size];
+  }
+
+  if (is_list_empty(&page_table_pages_head)) {
+    if (!page_table_page_alloc()) {
+      --page_table_stats.tables;
+      return NULL;
+    }
+  }
+
+  page = list_data(page_table_pages_head.next, struct page_table_page, link);
+  slot = __builtin_ctz(~page->map);
+  page->map |= 1 << slot;
+
+  /* A full page table page can't satisfy any more allocations. */
+  if (--page->free == 0) {
+    list_remove(&page_table_pages_head, &page->link);
+  }
+
+  ret = (uint32_t*)((char*)page + slot * PAGE_TABLE_SIZE);
+  page->counts[slot] = 0;
+  memset(ret, 0, PAGE_TABLE_SIZE);
+
+  return ret;
+}
+
+/*
+  page_table_free frees the page table "page_table". If there is room in the
+  page table cache, then the page table is cleared and cached. Otherwise, it is
+  freed back to its page table page.
+*/
+void page_table_free(uint32_t* page_table) {
+  struct page_table_page* page;
+  size_t slot;
+
+  if (!page_table) {
+    return;
+  }
+
+  --page_table_stats.tables;
+  page = page_table_to_page(page_table);
+  slot = page_table_slot(page_table);
+
+  if (page_table_cache_size < PAGE_TABLE_CACHE_SIZE) {
+    /* An empty page table is already cleared. */
+    if (page->counts[slot]) {
+      memset(page_table, 0, PAGE_TABLE_SIZE);
+      page->counts[slot] = 0;
+    }
+
+    page_table_cache[page_table_cache_size++] = page_table;
+    return;
+  }
+
+  page->map &= ~(1 << slot);
+
+  /* A full page table page can satisfy allocations again. */
+  if (page->free++ == 0) {
+    list_push(&page_table_pages_head, &page->link);
+  }
+
+  /*
+    If the page table page is empty and isn't the only one with free slots,
+    then we free it.
+  */
+  if (page->free == PAGE_TABLE_PAGE_SLOTS - 1 && (page_table_pages_head.next != &page->link || page->link.next != &page_table_pages_head)) {
+    list_remove(&page_table_pages_head, &page->link);
+    page_table_page_free(page);
+  }
+}
+
+/*
+  page_table_page_alloc allocates a page table page, links it into the page
+  table pages, and returns it. The first slot is reserved for the header.
+*/
+struct page_table_page* page_table_page_alloc() {
+  struct page_table_page* ret;
+
+  ret = memory_page_alloc(order_count(PAGE_TABLE_PAGE_ORDER));
+
+  if (!ret) {
+    return NULL;
+  }
+
+  ret->free = PAGE_TABLE_PAGE_SLOTS - 1;
+  ret->map = 1;
+  list_push(&page_table_pages_head, &ret->link);
+  ++page_table_stats.pages;
+
+  return ret;
+}
+
+/*
+  page_table_page_free frees the page table page "page" back to the page
+  allocator.
+*/
+void page_table_page_free(struct page_table_page* page) {
+  --page_table_stats.pages;
+  memory_free(page);
+}
+
+/*
+  page_table_to_page returns the page table page which contains the page table
+  "page_table".
+*/
+struct page_table_page* page_table_to_page(const uint32_t* page_table) {
+  return (struct page_table_page*)ALIGN_DOWN((uint32_t)page_table, PAGE_TABLE_PAGE_SIZE);
+}
+
+/*
+  page_table_slot returns the slot of the page table "page_table" in its page
+  table page.
+*/
+size_t page_table_slot(const uint32_t* page_table) {
+  return ((uint32_t)page_table & (PAGE_TABLE_PAGE_SIZE - 1)) / PAGE_TABLE_SIZE;
+}
+
+/*
+  page_table_count returns a pointer to the number of valid entries in the page
+  table "page_table".
+*/
+uint16_t* page_table_count(const uint32_t* page_table) {
+  return &page_table_to_page(page_table)->counts[page_table_slot(page_table)];
+}
@@ -0,0 +1,56 @@
+#ifndef PAGE_TABLE_H
+#define PAGE_TABLE_H
+
+#include <kernel/asm/page.h>
+#include <kernel/list.h>
+#include <kernel/memory.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PAGE_TABLE_PAGE_ORDER 2
+#define PAGE_TABLE_PAGE_SIZE (order_count(PAGE_TABLE_PAGE_ORDER) * PAGE_SIZE)
+#define PAGE_TABLE_PAGE_SLOTS (PAGE_TABLE_PAGE_SIZE / PAGE_TABLE_SIZE)
+#define PAGE_TABLE_CACHE_SIZE 16
+
+/*
+  struct page_table_page represents the header of a page table page. A page
+  table page is a naturally aligned block of pages which is split into page
+  table sized slots. The header occupies the first slot, "map" has a bit set
+  for every used slot, and "counts" has the number of valid entries in the
+  page table of every slot.
+*/
+struct page_table_page {
+  size_t free;
+  uint16_t map;
+  uint16_t counts[PAGE_TABLE_PAGE_SLOTS];
+  struct list_link link;
+};
+
+/*
+  struct page_table_stats represents the page table allocator counters.
+  "tables" is the number of allocated page tables, "pages" is the number of
+  page table pages, and "cache_hits" is the number of allocations which were
+  satisfied by the page table cache.
+*/
+struct page_table_stats {
+  size_t tables;
+  size_t pages;
+  size_t cache_hits;
+};
+
+extern struct list_link page_table_pages_head;
+extern uint32_t* page_table_cache[PAGE_TABLE_CACHE_SIZE];
+extern size_t page_table_cache_size;
+extern struct page_table_stats page_table_stats;
+
+uint32_t* page_table_alloc();
+void page_table_free(uint32_t* page_table);
+
+struct page_table_page* page_table_page_alloc();
+void page_table_page_free(struct page_table_page* page);
+
+struct page_table_page* page_table_to_page(const uint32_t* page_table);
+size_t page_table_slot(const uint32_t* page_table);
+uint16_t* page_table_count(const uint32_t* page_table);
+
+#endif
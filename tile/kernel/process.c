@@ -2,18 +2,28 @@
 #include <kernel/interrupts.h>
 #include <kernel/asm/memory.h>
 #include <kernel/asm/processor.h>
+#include <kernel/buffer.h>
 #include <kernel/memory.h>
 #include <kernel/page.h>
+#include <kernel/page_cache.h>
 #include <lib/string.h>
 
 struct list_link processes_head = LIST_INIT(processes_head);
 
+/*
+  A process's information and stack is stored in a buffer of THREAD_SIZE which
+  must be aligned to THREAD_SIZE so that current_process can find it.
+*/
+struct kmem_cache process_cache = KMEM_CACHE_INIT(process_cache, "process_info", THREAD_SIZE, THREAD_SIZE, NULL);
+
 int process_num_count;
 
 struct memory_info init_memory_info = {
-  .stack_buf = NULL,
+  .faults = 0,
+  .context_id = 0,
   .pgd = (uint32_t*)phys_to_virt(PG_DIR_PADDR),
   .pages_head = LIST_INIT(init_memory_info.pages_head),
+  .pages_root = TREE_ROOT_INIT,
   .text_begin = (uint32_t)&text_begin,
   .text_end = (uint32_t)&text_end,
   .data_begin = (uint32_t)&data_begin,
@@ -46,7 +56,7 @@ int process_clone(int type, struct function_info* func) {
     A process's information and stack is stored in a buffer of THREAD_SIZE at
     the bottom is the process information and directly above it, is its stack.
   */
-  proc = memory_alloc(THREAD_SIZE);
+  proc = kmem_cache_alloc(&process_cache);
 
   if (!proc) {
     return -1;
@@ -59,6 +69,11 @@ int process_clone(int type, struct function_info* func) {
   /* Userspace processes have a unique virtual memory context. */
   if (type == PT_USER) {
     proc->mem = copy_memory_info(current->mem);
+
+    if (!proc->mem) {
+      kmem_cache_free(&process_cache, proc);
+      return -1;
+    }
   }
 
   proc->num = num;
@@ -82,13 +97,8 @@ int process_exec(const char* filename, const char** argv, const char** envp) {
   struct memory_info* curr_mem;
   struct memory_info* mem;
   int fd;
-  struct file_info_int* file;
-  uint32_t file_size;
-  void* file_buf;
   int retval;
-  void* stack_buf;
-  uint32_t stack_paddr;
-  uint32_t stack_vaddr;
+  struct page_region* stack;
 
   curr_mem = current->mem;
   mem = create_memory_info();
@@ -103,46 +113,34 @@ int process_exec(const char* filename, const char** argv, const char** envp) {
     return -1;
   }
 
-  file = (&current->file_tab[fd])->file;
-  file_size = file->ext.size;
-
-  file_buf = memory_alloc(ALIGN(file_size, PAGE_SIZE));
-
-  if (!file_buf) {
-    file_close(fd);
-    return -1;
-  }
-
-  file_read(fd, file_buf, file_size);
+  retval = load_elf(mem, fd);
   file_close(fd);
 
-  retval = load_elf(mem, file_buf);
-  memory_free(file_buf);
-
   if (retval < 0) {
     return -1;
   }
 
-  // Initialize the process's stack.
-  stack_buf = memory_alloc(THREAD_SIZE);
-
-  if (!stack_buf) {
-    return -1;
-  }
+  /*
+    Reserve the first page of the process's stack at the top of userspace. The
+    stack grows down when it is touched below that, and its pages are faulted
+    in when touched.
+  */
+  stack = create_anon_page_region(STACK_TOP - PAGE_SIZE, 1, PAGE_RW | PAGE_GROWSDOWN);
 
-  stack_paddr = virt_to_phys((uint32_t)stack_buf);
-  stack_vaddr = (uint32_t)find_unmapped_region(mem, THREAD_SIZE);
-  if (!create_mapping(mem, stack_vaddr, stack_paddr, THREAD_SIZE, PAGE_RW)) {
+  if (!stack || !is_region_unmapped(mem, stack->begin, PAGE_SIZE) || insert_page_region(mem, stack) < 0) {
+    free_page_region(stack);
     return -1;
   }
 
   current->reg.cpsr = PM_USR;
-  current->reg.sp = stack_end(stack_vaddr);
-  mem->stack_buf = stack_buf;
+  current->reg.sp = STACK_TOP - 8;
   current->mem = mem;
-  set_pgd(virt_to_phys((uint32_t)(mem->pgd)));
+  switch_memory_info(mem);
 
-  free_memory_info(curr_mem);
+  /* Kernel processes share the kernel's memory context, which is kept. */
+  if (curr_mem != &init_memory_info) {
+    free_memory_info(curr_mem);
+  }
 
   return 0;
 }
@@ -158,13 +156,19 @@ void process_exit(int status) {
   list_remove(&processes_head, &proc->link);
   proc->sched.reschedule = true;
 
-  /* Clean up held resources. */
-  free_page_regions(mem);
-
   close_open_files();
 
-  memory_free(mem);
-  memory_free(proc);
+  /*
+    Move off the exiting memory context before tearing it down, so that TTBR0
+    never points to a freed page global directory.
+  */
+  if (mem != &init_memory_info) {
+    proc->mem = &init_memory_info;
+    switch_memory_info(&init_memory_info);
+    free_memory_info(mem);
+  }
+
+  kmem_cache_free(&process_cache, proc);
 }
 
 /*
@@ -190,59 +194,148 @@ int next_process_number() {
 }
 
 /*
-  load_elf loads an ELF file into the userspace portion of the current process.
-  It loads all of the loadable segments and sets the program counter to the
-  entry point.
+  load_elf loads the ELF file specified by the file descriptor "fd" into the
+  memory context "mem" and sets the program counter to the entry point. Only
+  the headers are read here, the loadable segments are demand paged.
 */
-int load_elf(struct memory_info* mem, const void* elf) {
-  const struct elf_hdr* hdr;
-  const struct elf_phdr* phdr;
-  int flags;
-  uint32_t segment_size;
-  uint32_t segment_vaddr;
-  uint32_t segment_offset;
-  void* segment;
-  void *retval;
+int load_elf(struct memory_info* mem, int fd) {
+  struct elf_hdr hdr;
+  struct elf_phdr* phdr;
+  int phdr_size;
+  int ret = 0;
+
+  if (file_read(fd, (char*)&hdr, sizeof(hdr)) != sizeof(hdr) || !is_elf_header_valid(&hdr)) {
+    return -1;
+  }
 
-  hdr = (struct elf_hdr*)elf;
+  phdr_size = hdr.e_phnum * sizeof(struct elf_phdr);
+  phdr = memory_alloc(phdr_size);
 
-  if (!is_elf_header_valid(hdr)) {
+  if (!phdr) {
     return -1;
   }
 
-  phdr = (struct elf_phdr*)((uint32_t)elf + hdr->e_phoff);
+  file_seek(fd, hdr.e_phoff);
 
-  for (const struct elf_phdr* p = phdr; p < phdr + hdr->e_phnum; ++p) {
+  if (file_read(fd, (char*)phdr, phdr_size) != phdr_size) {
+    memory_free(phdr);
+    return -1;
+  }
+
+  for (const struct elf_phdr* p = phdr; p < phdr + hdr.e_phnum; ++p) {
     /* We only care about PT_LOAD segments. */
     if (p->p_type != PT_LOAD) {
       continue;
     }
 
-    /*
-      Align the segment to a PAGE_SIZE, allocate our own segment, copy into it,
-      and map it.
-    */
-    segment_size = ALIGN(p->p_memsz, PAGE_SIZE);
-    segment = memory_alloc(segment_size);
+    ret = load_elf_segment(mem, fd, p);
+
+    if (ret < 0) {
+      break;
+    }
+  }
+
+  memory_free(phdr);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  current->reg.pc = hdr.e_entry;
+
+  return 0;
+}
+
+/*
+  load_elf_segment maps the loadable segment "phdr" of the ELF file specified by
+  the file descriptor "fd" into the memory context "mem". The pages which hold
+  file data are backed by the file and are faulted in when touched. Writable
+  segments are mapped privately so that their file pages are copied on write.
+  The rest of the segment is zero-initialized and is reserved as an anonymous
+  page region.
+*/
+int load_elf_segment(struct memory_info* mem, int fd, const struct elf_phdr* phdr) {
+  struct file_info_int* file = fd_to_file(fd);
+  const uint32_t begin = ALIGN_DOWN(phdr->p_vaddr, PAGE_SIZE);
+  const uint32_t file_end = phdr->p_vaddr + phdr->p_filesz;
+  const uint32_t end = ALIGN(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+  const uint32_t file_offset = ALIGN_DOWN(phdr->p_offset, PAGE_SIZE);
+  uint32_t anon_begin;
+  int flags;
+  struct page_region* region;
+  struct filesystem_addr fs_addr;
+  struct buffer_info* buffer;
+  struct phys_page* page;
+
+  /* File pages are mapped directly, so the segment must be page aligned. */
+  if ((phdr->p_vaddr - phdr->p_offset) & (PAGE_SIZE - 1)) {
+    return -1;
+  }
+
+  flags = elf_segment_to_page_flags(phdr->p_flags);
+
+  /*
+    If the segment is zero-initialized past its file data, then the page which
+    holds the end of the file data belongs to the anonymous page region.
+  */
+  if (phdr->p_memsz > phdr->p_filesz) {
+    anon_begin = ALIGN_DOWN(file_end, PAGE_SIZE);
+  }
+  else {
+    anon_begin = ALIGN(file_end, PAGE_SIZE);
+  }
+
+  if (anon_begin > begin) {
+    region = create_file_page_region(begin, page_count(anon_begin - begin), flags & PAGE_WRITE ? flags | PAGE_PRIVATE : flags, file);
+
+    if (!region) {
+      return -1;
+    }
+
+    region->file_offset = file_offset;
 
-    if (!segment) {
+    if (insert_page_region(mem, region) < 0) {
+      free_page_region(region);
       return -1;
     }
+  }
+
+  if (end <= anon_begin) {
+    return 0;
+  }
 
-    segment_vaddr = ALIGN_DOWN(p->p_vaddr, PAGE_SIZE);
-    segment_offset = p->p_vaddr - segment_vaddr;
-    flags = elf_segment_to_page_flags(p->p_flags);
+  region = create_anon_page_region(anon_begin, page_count(end - anon_begin), flags);
 
-    memcpy((char*)segment + segment_offset, (char*)elf + p->p_offset, p->p_memsz);
+  if (!region) {
+    return -1;
+  }
 
-    retval = create_mapping(mem, segment_vaddr, virt_to_phys((uint32_t)segment), segment_size, flags);
+  /* The end of the file data is copied now and the rest of its page is zeroed. */
+  if (file_end > anon_begin) {
+    fs_addr = file_offset_to_addr(file, file_offset + (anon_begin - begin));
+    buffer = buffer_get(fs_addr.num);
+    page = pages_alloc(1, ZONE_LOWMEM);
 
-    if (!retval) {
+    if (!buffer || !page || !map_page(mem, anon_begin, page_to_phys(page), flags)) {
+      if (page) {
+        page_put(page);
+      }
+
+      buffer_put(buffer);
+      free_page_region(region);
       return -1;
     }
+
+    memset((void*)page_to_virt(page), 0, PAGE_SIZE);
+    memcpy((void*)page_to_virt(page), buffer->data, file_end - anon_begin);
+    buffer_put(buffer);
+    region->pages[0] = page;
   }
 
-  current->reg.pc = hdr->e_entry;
+  if (insert_page_region(mem, region) < 0) {
+    free_page_region(region);
+    return -1;
+  }
 
   return 0;
 }
@@ -345,13 +438,23 @@ struct memory_info* create_memory_info() {
     return NULL;
   }
 
-  mem->stack_buf = NULL;
+  mem->faults = 0;
+  mem->context_id = 0;
   mem->pgd = create_pgd();
 
+  if (!mem->pgd) {
+    memory_free(mem);
+    return NULL;
+  }
+
   list_init(&mem->pages_head);
-  create_page_region_bounds(mem);
+  mem->pages_root.node = NULL;
+  mem->stack_limit = STACK_TOP - STACK_MAX_SIZE;
 
-  create_page_region_bounds(mem);
+  if (create_page_region_bounds(mem, USER_VADDR_END) < 0) {
+    free_memory_info(mem);
+    return NULL;
+  }
 
   return mem;
 }
@@ -359,8 +462,10 @@ struct memory_info* create_memory_info() {
 /*
   copy_memory_info creates and returns a copy of the memory context "mem". It
   is used when a process does not wish to share the parent's memory context.
+  The copy shares the pages of "mem" and private writable pages are copied on
+  write. If any of it can't be copied, then NULL is returned.
 */
-struct memory_info* copy_memory_info(const struct memory_info* mem) {
+struct memory_info* copy_memory_info(struct memory_info* mem) {
   struct memory_info* dest_mem;
 
   dest_mem = create_memory_info();
@@ -369,15 +474,18 @@ struct memory_info* copy_memory_info(const struct memory_info* mem) {
     return NULL;
   }
 
-  copy_page_regions(dest_mem, mem);
+  if (copy_page_regions(dest_mem, mem) < 0) {
+    free_memory_info(dest_mem);
+    return NULL;
+  }
 
   return dest_mem;
 }
 
 void free_memory_info(struct memory_info* mem) {
-  memory_free(mem->stack_buf);
   free_pgd(mem->pgd);
   free_page_regions(mem);
+  page_cache_reclaim();
 
   memory_free(mem);
 }
@@ -5,6 +5,8 @@
 #include <kernel/file.h>
 #include <kernel/processor.h>
 #include <kernel/schedule.h>
+#include <kernel/slab.h>
+#include <kernel/tree.h>
 #include <lib/elf.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -37,11 +39,18 @@ enum process_type {
 
 /*
   struct memory_info represents the virtual memory information of a process.
+  "faults" is the number of pages which have been faulted in, and
+  "context_id" is its ASID together with the generation it was allocated in.
+  The page regions are linked in both "pages_head" and "pages_root".
+  "stack_limit" is the lowest address which the stack can grow down to.
 */
 struct memory_info {
-  void* stack_buf;
+  size_t faults;
+  uint32_t context_id;
   uint32_t* pgd;
   struct list_link pages_head;
+  struct tree_root pages_root;
+  uint32_t stack_limit;
   uint32_t text_begin;
   uint32_t text_end;
   uint32_t data_begin;
@@ -83,6 +92,7 @@ extern void* init_process_end;
 extern void* init_process_stack;
 
 extern struct list_link processes_head;
+extern struct kmem_cache process_cache;
 extern int process_num_count;
 extern struct memory_info init_memory_info;
 extern struct process_info init_process;
@@ -107,7 +117,8 @@ int process_getuid();
 
 int next_process_number();
 
-int load_elf(struct memory_info* mem, const void* elf);
+int load_elf(struct memory_info* mem, int fd);
+int load_elf_segment(struct memory_info* mem, int fd, const struct elf_phdr* phdr);
 bool is_elf_header_valid(const struct elf_hdr* hdr);
 int elf_segment_to_page_flags(uint32_t flags);
 
@@ -116,7 +127,7 @@ struct processor_registers* current_registers();
 void function_to_process(struct process_info* proc, struct function_info* func);
 
 struct memory_info* create_memory_info();
-struct memory_info* copy_memory_info(const struct memory_info* mem);
+struct memory_info* copy_memory_info(struct memory_info* mem);
 void free_memory_info(struct memory_info* mem);
 
 #endif
@@ -45,6 +45,8 @@ struct context_registers {
 
 extern void enable_interrupts();
 extern void disable_interrupts();
+extern uint32_t save_interrupts();
+extern void restore_interrupts(uint32_t cpsr);
 extern void set_processor_mode(uint32_t mode);
 extern void restore_registers(struct processor_registers* r);
 
@@ -1,9 +1,12 @@
 #include <kernel/schedule.h>
+#include <kernel/buffer.h>
 #include <kernel/list.h>
 #include <kernel/memory.h>
 #include <kernel/page.h>
 #include <kernel/process.h>
 
+volatile uint32_t schedule_ticks = 0;
+
 /*
   schedule_init initializes the scheduler.
 */
@@ -12,16 +15,21 @@ void schedule_init() {
 }
 
 /*
-  schedule_tick determines if the current process needs to be rescheduled.
+  schedule_tick determines if the current process needs to be rescheduled. It
+  also wakes the buffer cache flusher when it is due.
 */
 void schedule_tick() {
+  ++schedule_ticks;
+  buffer_flush_tick();
+
   /* For now, the current process is always rescheduled. */
   current->sched.reschedule = true;
 }
 
 /*
   schedule schedules the next process to be executed and context switches to
-  it.
+  it. Blocked processes are skipped, and if no other process can run, then the
+  current one continues.
 */
 void schedule() {
   struct list_link* next;
@@ -33,15 +41,22 @@ void schedule() {
 
   next = current->link.next;
 
-  if (next == &processes_head) {
+  do {
+    if (next == &processes_head) {
+      next = next->next;
+    }
+
+    proc = list_data(next, struct process_info, link);
     next = next->next;
-  }
+  } while (proc != current && proc->state == PS_BLOCKED);
 
-  proc = list_data(next, struct process_info, link);
+  if (proc == current) {
+    return;
+  }
 
   /* If the next process has a different memory context, then we switch it too. */
   if (current->mem != proc->mem) {
-    set_pgd(virt_to_phys((uint32_t)(proc->mem->pgd)));
+    switch_memory_info(proc->mem);
   }
 
   context_switch(&current->context_reg, &proc->context_reg);
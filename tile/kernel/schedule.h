@@ -3,6 +3,7 @@
 
 #include <kernel/processor.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
   schedule_info represents scheduling information about a process.
@@ -12,6 +13,11 @@ struct schedule_info {
   bool preempt;
 };
 
+/*
+  "schedule_ticks" is the number of scheduler ticks since boot.
+*/
+extern volatile uint32_t schedule_ticks;
+
 void schedule_init();
 void schedule_tick();
 void schedule();
@@ -0,0 +1,190 @@
+/*
+  slab.c handles object caches.
+
+  An object cache allocates objects of a single size and type. Objects are
+  carved out of slabs, which are naturally aligned blocks of pages from the
+  page allocator. Because a slab is naturally aligned, the slab which contains
+  an object is found by aligning the object's address down to the slab size.
+
+  Each slab tracks its free objects in a list which is threaded through the
+  free objects themselves, so both allocation and freeing take constant time.
+*/
+
+#include <kernel/slab.h>
+#include <kernel/asm/page.h>
+#include <kernel/memory.h>
+
+struct list_link kmem_caches_head = LIST_INIT(kmem_caches_head);
+
+/*
+  kmem_cache_alloc allocates an object from the object cache "cache" and
+  returns a pointer to it. If the cache has a constructor, then it is called
+  on the object before it is returned.
+*/
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+  struct kmem_slab* slab;
+  void* ret;
+
+  /* There are no free objects so we allocate a new slab. */
+  if (is_list_empty(&cache->partial_head)) {
+    slab = kmem_slab_alloc(cache);
+
+    if (!slab) {
+      ++cache->failed;
+      return NULL;
+    }
+
+    list_push(&cache->partial_head, &slab->link);
+  }
+
+  slab = list_data(cache->partial_head.next, struct kmem_slab, link);
+
+  ret = slab->free;
+  slab->free = *(void**)ret;
+  ++slab->in_use;
+  ++cache->in_use;
+
+  if (!slab->free) {
+    list_remove(&cache->partial_head, &slab->link);
+    list_push(&cache->full_head, &slab->link);
+  }
+
+  if (cache->ctor) {
+    cache->ctor(ret);
+  }
+
+  return ret;
+}
+
+/*
+  kmem_cache_free frees the object which "ptr" points to back to the object
+  cache "cache". If its slab becomes empty and isn't the only slab with free
+  objects, then the slab is freed.
+*/
+void kmem_cache_free(struct kmem_cache* cache, void* ptr) {
+  struct kmem_slab* slab;
+
+  if (!ptr) {
+    return;
+  }
+
+  slab = ptr_to_slab(cache, ptr);
+
+  /* A full slab has a free object again. */
+  if (!slab->free) {
+    list_remove(&cache->full_head, &slab->link);
+    list_push(&cache->partial_head, &slab->link);
+  }
+
+  *(void**)ptr = slab->free;
+  slab->free = ptr;
+  --slab->in_use;
+  --cache->in_use;
+
+  if (!slab->in_use && (cache->partial_head.next != &slab->link || slab->link.next != &cache->partial_head)) {
+    list_remove(&cache->partial_head, &slab->link);
+    kmem_slab_free(slab);
+  }
+}
+
+/*
+  kmem_cache_layout determines the order of the slabs in the object cache
+  "cache" and how many objects each of them holds. The order is the smallest
+  one which holds at least KMEM_SLAB_MIN_OBJECTS objects, but no larger than
+  KMEM_SLAB_MAX_ORDER.
+*/
+void kmem_cache_layout(struct kmem_cache* cache) {
+  const size_t offset = kmem_cache_object_offset(cache);
+  const size_t size = kmem_cache_object_size(cache);
+  size_t slab_size;
+
+  for (cache->order = 0; ; ++cache->order) {
+    slab_size = order_count(cache->order) * PAGE_SIZE;
+    cache->count = slab_size > offset ? (slab_size - offset) / size : 0;
+
+    if (cache->count >= KMEM_SLAB_MIN_OBJECTS || cache->order == KMEM_SLAB_MAX_ORDER) {
+      break;
+    }
+  }
+}
+
+/*
+  kmem_cache_object_offset returns the offset of the first object from the
+  beginning of a slab in the object cache "cache".
+*/
+size_t kmem_cache_object_offset(const struct kmem_cache* cache) {
+  size_t align = cache->align > sizeof(void*) ? cache->align : sizeof(void*);
+
+  return ALIGN(sizeof(struct kmem_slab), align);
+}
+
+/*
+  kmem_cache_object_size returns the size of an object including its padding
+  in the object cache "cache".
+*/
+size_t kmem_cache_object_size(const struct kmem_cache* cache) {
+  size_t align = cache->align > sizeof(void*) ? cache->align : sizeof(void*);
+
+  return ALIGN(cache->size, align);
+}
+
+/*
+  kmem_slab_alloc allocates a slab for the object cache "cache" and links all
+  of its objects into its free list. It returns the slab on success.
+*/
+struct kmem_slab* kmem_slab_alloc(struct kmem_cache* cache) {
+  struct kmem_slab* slab;
+  char* object;
+  size_t size;
+
+  if (!cache->count) {
+    kmem_cache_layout(cache);
+
+    if (!cache->count) {
+      return NULL;
+    }
+  }
+
+  slab = memory_page_alloc(order_count(cache->order));
+
+  if (!slab) {
+    return NULL;
+  }
+
+  /* The object cache is exposed once it has allocated its first slab. */
+  if (!cache->link.next) {
+    list_push(&kmem_caches_head, &cache->link);
+  }
+
+  size = kmem_cache_object_size(cache);
+  object = (char*)slab + kmem_cache_object_offset(cache);
+
+  slab->cache = cache;
+  slab->free = object;
+  slab->in_use = 0;
+
+  for (size_t i = 0; i < cache->count - 1; ++i, object += size) {
+    *(void**)object = object + size;
+  }
+
+  *(void**)object = NULL;
+  ++cache->slabs;
+
+  return slab;
+}
+
+/*
+  kmem_slab_free frees the slab "slab" back to the page allocator.
+*/
+void kmem_slab_free(struct kmem_slab* slab) {
+  --slab->cache->slabs;
+  memory_free(slab);
+}
+
+/*
+  ptr_to_slab returns the slab in the object cache "cache" which contains the
+  object "ptr".
+*/
+struct kmem_slab* ptr_to_slab(const struct kmem_cache* cache, const void* ptr) {
+  return (struct kmem_slab*)ALIGN_DOWN((uint32_t)ptr, order_count(cache->order) * PAGE_SIZE);
+}
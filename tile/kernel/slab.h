@@ -0,0 +1,72 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <kernel/list.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KMEM_SLAB_MIN_OBJECTS 4
+#define KMEM_SLAB_MAX_ORDER 4
+
+/*
+  KMEM_CACHE_INIT initializes the object cache "cache" named "n" for objects of
+  "s" bytes aligned to "a" bytes with the constructor "c". Should only be used
+  for compile-time initialization.
+*/
+#define KMEM_CACHE_INIT(cache, n, s, a, c) { \
+  .name = n, \
+  .size = s, \
+  .align = a, \
+  .ctor = c, \
+  .partial_head = LIST_INIT(cache.partial_head), \
+  .full_head = LIST_INIT(cache.full_head) \
+}
+
+/*
+  struct kmem_cache represents a cache of fixed size objects. Objects are
+  allocated from slabs, which are naturally aligned blocks of pages. Slabs with
+  free objects are linked in "partial_head" and slabs without free objects are
+  linked in "full_head". "in_use", "slabs", and "failed" respectively count
+  the allocated objects, the allocated slabs, and the failed allocations.
+*/
+struct kmem_cache {
+  const char* name;
+  size_t size;
+  size_t align;
+  void (*ctor)(void*);
+  int order;
+  size_t count;
+  struct list_link partial_head;
+  struct list_link full_head;
+  size_t in_use;
+  size_t slabs;
+  size_t failed;
+  struct list_link link;
+};
+
+/*
+  struct kmem_slab represents a slab. It is stored at the beginning of the
+  slab's memory and is followed by the slab's objects. "free" points to the
+  first free object, and each free object points to the next one.
+*/
+struct kmem_slab {
+  struct kmem_cache* cache;
+  void* free;
+  size_t in_use;
+  struct list_link link;
+};
+
+extern struct list_link kmem_caches_head;
+
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* ptr);
+
+void kmem_cache_layout(struct kmem_cache* cache);
+size_t kmem_cache_object_offset(const struct kmem_cache* cache);
+size_t kmem_cache_object_size(const struct kmem_cache* cache);
+
+struct kmem_slab* kmem_slab_alloc(struct kmem_cache* cache);
+void kmem_slab_free(struct kmem_slab* slab);
+struct kmem_slab* ptr_to_slab(const struct kmem_cache* cache, const void* ptr);
+
+#endif
@@ -9,6 +9,7 @@
 
 #include <kernel/syscall.h>
 #include <kernel/file.h>
+#include <kernel/page.h>
 #include <kernel/process.h>
 
 /*
@@ -30,7 +31,12 @@ uint32_t syscall_table[] = {
   (uint32_t)process_getpid,
   (uint32_t)process_getuid,
   (uint32_t)process_exec,
-  (uint32_t)process_exit
+  (uint32_t)process_exit,
+  (uint32_t)region_map,
+  (uint32_t)region_unmap,
+  (uint32_t)region_protect,
+  (uint32_t)file_sync,
+  (uint32_t)file_fsync
 };
 
 /*
@@ -0,0 +1,309 @@
+/*
+  tree.c handles red-black trees.
+
+  A red-black tree is a binary search tree which stays balanced by coloring its
+  nodes. The root is black, a red node has no red children, and every path
+  from a node to its leaves has the same number of black nodes. So the longest
+  path is at most twice the shortest one, and a tree of n nodes has a height of
+  O(log n).
+*/
+
+#include <kernel/tree.h>
+
+/*
+  tree_link links the tree node "node" as a child of "parent" at the child
+  pointer "link". It must be followed by tree_insert to rebalance the tree.
+*/
+void tree_link(struct tree_node* node, struct tree_node* parent, struct tree_node** link) {
+  node->parent = parent;
+  node->left = NULL;
+  node->right = NULL;
+  node->color = TREE_RED;
+  *link = node;
+}
+
+/*
+  tree_insert rebalances the tree with root "root" after the tree node "node"
+  has been linked into it.
+*/
+void tree_insert(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*)) {
+  struct tree_node* parent;
+  struct tree_node* grandparent;
+  struct tree_node* uncle;
+
+  tree_propagate(node, update);
+
+  /* A red parent always has a parent since the root is black. */
+  while ((parent = node->parent) && parent->color == TREE_RED) {
+    grandparent = parent->parent;
+
+    if (parent == grandparent->left) {
+      uncle = grandparent->right;
+
+      if (!is_tree_node_black(uncle)) {
+        parent->color = TREE_BLACK;
+        uncle->color = TREE_BLACK;
+        grandparent->color = TREE_RED;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->right) {
+        node = parent;
+        tree_rotate_left(root, node, update);
+        parent = node->parent;
+      }
+
+      parent->color = TREE_BLACK;
+      grandparent->color = TREE_RED;
+      tree_rotate_right(root, grandparent, update);
+    }
+    else {
+      uncle = grandparent->left;
+
+      if (!is_tree_node_black(uncle)) {
+        parent->color = TREE_BLACK;
+        uncle->color = TREE_BLACK;
+        grandparent->color = TREE_RED;
+        node = grandparent;
+        continue;
+      }
+
+      if (node == parent->left) {
+        node = parent;
+        tree_rotate_right(root, node, update);
+        parent = node->parent;
+      }
+
+      parent->color = TREE_BLACK;
+      grandparent->color = TREE_RED;
+      tree_rotate_left(root, grandparent, update);
+    }
+  }
+
+  root->node->color = TREE_BLACK;
+}
+
+/*
+  tree_remove removes the tree node "node" from the tree with root "root" and
+  rebalances it.
+*/
+void tree_remove(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*)) {
+  struct tree_node* child;
+  struct tree_node* parent;
+  struct tree_node* next;
+  int color;
+
+  if (!node->left || !node->right) {
+    child = node->left ? node->left : node->right;
+    parent = node->parent;
+    color = node->color;
+
+    if (child) {
+      child->parent = parent;
+    }
+
+    tree_change_child(root, parent, node, child);
+  }
+  else {
+    /* The node is replaced by its successor which has no left child. */
+    next = node->right;
+
+    while (next->left) {
+      next = next->left;
+    }
+
+    child = next->right;
+    color = next->color;
+
+    if (next->parent == node) {
+      parent = next;
+    }
+    else {
+      parent = next->parent;
+      parent->left = child;
+
+      if (child) {
+        child->parent = parent;
+      }
+
+      next->right = node->right;
+      node->right->parent = next;
+    }
+
+    next->left = node->left;
+    node->left->parent = next;
+    next->parent = node->parent;
+    next->color = node->color;
+    tree_change_child(root, node->parent, node, next);
+  }
+
+  tree_propagate(parent, update);
+
+  if (color == TREE_BLACK) {
+    tree_remove_fixup(root, child, parent, update);
+  }
+}
+
+/*
+  tree_remove_fixup restores the black heights of the tree with root "root"
+  after a black node was removed above the tree node "node" whose parent is
+  "parent". "node" may be NULL.
+*/
+void tree_remove_fixup(struct tree_root* root, struct tree_node* node, struct tree_node* parent, void (*update)(struct tree_node*)) {
+  struct tree_node* sibling;
+
+  while (node != root->node && is_tree_node_black(node)) {
+    if (node == parent->left) {
+      sibling = parent->right;
+
+      if (!is_tree_node_black(sibling)) {
+        sibling->color = TREE_BLACK;
+        parent->color = TREE_RED;
+        tree_rotate_left(root, parent, update);
+        sibling = parent->right;
+      }
+
+      if (is_tree_node_black(sibling->left) && is_tree_node_black(sibling->right)) {
+        sibling->color = TREE_RED;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (is_tree_node_black(sibling->right)) {
+        sibling->left->color = TREE_BLACK;
+        sibling->color = TREE_RED;
+        tree_rotate_right(root, sibling, update);
+        sibling = parent->right;
+      }
+
+      sibling->color = parent->color;
+      parent->color = TREE_BLACK;
+      sibling->right->color = TREE_BLACK;
+      tree_rotate_left(root, parent, update);
+    }
+    else {
+      sibling = parent->left;
+
+      if (!is_tree_node_black(sibling)) {
+        sibling->color = TREE_BLACK;
+        parent->color = TREE_RED;
+        tree_rotate_right(root, parent, update);
+        sibling = parent->left;
+      }
+
+      if (is_tree_node_black(sibling->left) && is_tree_node_black(sibling->right)) {
+        sibling->color = TREE_RED;
+        node = parent;
+        parent = node->parent;
+        continue;
+      }
+
+      if (is_tree_node_black(sibling->left)) {
+        sibling->right->color = TREE_BLACK;
+        sibling->color = TREE_RED;
+        tree_rotate_left(root, sibling, update);
+        sibling = parent->left;
+      }
+
+      sibling->color = parent->color;
+      parent->color = TREE_BLACK;
+      sibling->left->color = TREE_BLACK;
+      tree_rotate_right(root, parent, update);
+    }
+
+    node = root->node;
+  }
+
+  if (node) {
+    node->color = TREE_BLACK;
+  }
+}
+
+/*
+  tree_propagate calls "update" on the tree node "node" and all of its
+  ancestors. It is used after the augmented data of "node" changes.
+*/
+void tree_propagate(struct tree_node* node, void (*update)(struct tree_node*)) {
+  if (!update) {
+    return;
+  }
+
+  while (node) {
+    update(node);
+    node = node->parent;
+  }
+}
+
+/*
+  tree_rotate_left rotates the tree node "node" left in the tree with root
+  "root", so that its right child takes its place.
+*/
+void tree_rotate_left(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*)) {
+  struct tree_node* right = node->right;
+
+  node->right = right->left;
+
+  if (right->left) {
+    right->left->parent = node;
+  }
+
+  right->parent = node->parent;
+  tree_change_child(root, node->parent, node, right);
+  right->left = node;
+  node->parent = right;
+
+  if (update) {
+    update(node);
+    update(right);
+  }
+}
+
+/*
+  tree_rotate_right rotates the tree node "node" right in the tree with root
+  "root", so that its left child takes its place.
+*/
+void tree_rotate_right(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*)) {
+  struct tree_node* left = node->left;
+
+  node->left = left->right;
+
+  if (left->right) {
+    left->right->parent = node;
+  }
+
+  left->parent = node->parent;
+  tree_change_child(root, node->parent, node, left);
+  left->right = node;
+  node->parent = left;
+
+  if (update) {
+    update(node);
+    update(left);
+  }
+}
+
+/*
+  tree_change_child replaces the child "old" of the tree node "parent" with
+  "new". If "parent" is NULL, then "new" becomes the root of "root".
+*/
+void tree_change_child(struct tree_root* root, struct tree_node* parent, struct tree_node* old, struct tree_node* new) {
+  if (!parent) {
+    root->node = new;
+  }
+  else if (parent->left == old) {
+    parent->left = new;
+  }
+  else {
+    parent->right = new;
+  }
+}
+
+/*
+  is_tree_node_black returns if the tree node "node" is black. NULL leaves are
+  black.
+*/
+bool is_tree_node_black(const struct tree_node* node) {
+  return !node || node->color == TREE_BLACK;
+}
@@ -0,0 +1,60 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Should only be used for compile-time initialization. */
+#define TREE_ROOT_INIT {NULL}
+
+/*
+  tree_data returns the data which the tree node "node" links given its type
+  "type" and member name "member".
+*/
+#define tree_data(node, type, member) ((type*)((uint32_t)(node) - (offsetof(type, member))))
+
+/*
+  enum tree_color represents the color of a red-black tree node.
+*/
+enum tree_color {
+  TREE_RED,
+  TREE_BLACK
+};
+
+/*
+  struct tree_node links arbitrary data in a red-black tree without needing to
+  know anything of the underlying data. The ordering of the nodes is decided by
+  where they are linked, so the tree's users do their own comparisons.
+*/
+struct tree_node {
+  struct tree_node* parent;
+  struct tree_node* left;
+  struct tree_node* right;
+  int color;
+};
+
+/*
+  struct tree_root represents the root of a red-black tree.
+*/
+struct tree_root {
+  struct tree_node* node;
+};
+
+/*
+  An augmented tree keeps data in each node which is computed from the node and
+  its children. The tree functions which take an "update" function call it on
+  every node whose children change, so that the augmented data stays correct.
+  It is NULL for trees which aren't augmented.
+*/
+void tree_link(struct tree_node* node, struct tree_node* parent, struct tree_node** link);
+void tree_insert(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*));
+void tree_remove(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*));
+void tree_remove_fixup(struct tree_root* root, struct tree_node* node, struct tree_node* parent, void (*update)(struct tree_node*));
+void tree_propagate(struct tree_node* node, void (*update)(struct tree_node*));
+void tree_rotate_left(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*));
+void tree_rotate_right(struct tree_root* root, struct tree_node* node, void (*update)(struct tree_node*));
+void tree_change_child(struct tree_root* root, struct tree_node* parent, struct tree_node* old, struct tree_node* new);
+bool is_tree_node_black(const struct tree_node* node);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+  vmalloc.c handles virtually contiguous kernel allocations.
+
+  A virtually contiguous allocation is made of individual pages which are
+  mapped next to each other between VMALLOC_BEGIN_VADDR and VMALLOC_END_VADDR
+  in the kernel's memory context. Its pages don't need to be physically
+  contiguous or in lowmem, so large allocations don't fail because of
+  fragmentation. Each allocation is a page region which is followed by an
+  unmapped guard page.
+*/
+
+#include <kernel/vmalloc.h>
+#include <kernel/process.h>
+
+/*
+  vmalloc allocates a virtually contiguous block of "size" bytes and returns a
+  pointer to it. Its pages are taken from highmem if possible.
+*/
+void* vmalloc(size_t size) {
+  struct memory_info* mem = &init_memory_info;
+  const size_t count = page_count(size);
+  struct page_region* region;
+  struct phys_page* page;
+  uint32_t v_addr;
+
+  if (!size) {
+    return NULL;
+  }
+
+  v_addr = (uint32_t)find_unmapped_region_between(mem, page_addr(count + 1), VMALLOC_BEGIN_VADDR, VMALLOC_END_VADDR);
+
+  if (!v_addr) {
+    return NULL;
+  }
+
+  /* The last page of the page region is the guard page and is never mapped. */
+  region = create_anon_page_region(v_addr, count + 1, PAGE_RW | PAGE_KERNEL);
+
+  if (!region) {
+    return NULL;
+  }
+
+  if (insert_page_region(mem, region) < 0) {
+    free_page_region(region);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    page = pages_alloc(1, ZONE_HIGHMEM);
+
+    if (!page) {
+      page = pages_alloc(1, ZONE_LOWMEM);
+    }
+
+    if (!page) {
+      vfree((void*)v_addr);
+      return NULL;
+    }
+
+    region->pages[i] = page;
+
+    if (!map_page(mem, v_addr + page_addr(i), page_to_phys(page), region->flags)) {
+      vfree((void*)v_addr);
+      return NULL;
+    }
+  }
+
+  return (void*)v_addr;
+}
+
+/*
+  vfree frees the virtually contiguous block which "ptr" points to.
+*/
+void vfree(void* ptr) {
+  struct memory_info* mem = &init_memory_info;
+  struct page_region* region;
+
+  if (!is_vmalloc_addr(ptr)) {
+    return;
+  }
+
+  region = find_page_region(mem, (uint32_t)ptr);
+
+  if (!region || region->begin != (uint32_t)ptr) {
+    return;
+  }
+
+  remove_mapping(mem, region->begin, page_region_size(region));
+}
+
+/*
+  is_vmalloc_addr returns if "ptr" points into the virtually contiguous
+  allocation area.
+*/
+bool is_vmalloc_addr(const void* ptr) {
+  return (uint32_t)ptr >= VMALLOC_BEGIN_VADDR && (uint32_t)ptr < VMALLOC_END_VADDR;
+}
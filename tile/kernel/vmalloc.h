@@ -0,0 +1,15 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <kernel/memory.h>
+#include <kernel/page.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+void* vmalloc(size_t size);
+void vfree(void* ptr);
+
+bool is_vmalloc_addr(const void* ptr);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+  wait.c provides wait queues and completions.
+
+  A process which has to wait for an event sleeps on a wait queue. It is marked
+  as blocked so that the scheduler skips it, and it runs again once the event
+  wakes the queue. Wait queues may be woken from interrupt handlers.
+
+  A completion is a wait queue together with a flag for a single event, so an
+  event which happens before the process sleeps isn't lost.
+*/
+
+#include <kernel/wait.h>
+#include <kernel/processor.h>
+#include <kernel/schedule.h>
+
+/*
+  wait_queue_init initializes the wait queue "wq".
+*/
+void wait_queue_init(struct wait_queue* wq) {
+  list_init(&wq->waiters_head);
+}
+
+/*
+  wait_queue_sleep blocks the current process on the wait queue "wq" and
+  schedules another process. It returns once the queue is woken, or straight
+  away if no other process can run, so the caller must check its condition
+  again. The caller should have interrupts disabled while checking its
+  condition and sleeping so that a wakeup can't be missed.
+*/
+void wait_queue_sleep(struct wait_queue* wq) {
+  struct wait_entry entry;
+  uint32_t cpsr;
+
+  cpsr = save_interrupts();
+
+  entry.proc = current;
+  list_push(&wq->waiters_head, &entry.link);
+
+  current->state = PS_BLOCKED;
+  current->sched.reschedule = true;
+  schedule();
+
+  current->state = PS_READY;
+  list_remove(&wq->waiters_head, &entry.link);
+
+  restore_interrupts(cpsr);
+}
+
+/*
+  wait_queue_wake makes every process which is sleeping on the wait queue "wq"
+  runnable again. Each sleeper removes itself from the queue.
+*/
+void wait_queue_wake(struct wait_queue* wq) {
+  struct list_link* curr;
+  uint32_t cpsr;
+
+  cpsr = save_interrupts();
+  curr = wq->waiters_head.next;
+
+  while (curr != &wq->waiters_head) {
+    list_data(curr, struct wait_entry, link)->proc->state = PS_READY;
+    curr = curr->next;
+  }
+
+  restore_interrupts(cpsr);
+}
+
+/*
+  completion_init initializes the completion "c".
+*/
+void completion_init(struct completion* c) {
+  c->done = false;
+  wait_queue_init(&c->wait);
+}
+
+/*
+  completion_wait sleeps until the completion "c" is done and then consumes
+  it. Interrupts are let in between sleeps, in case no other process could run
+  and the event comes from an interrupt handler.
+*/
+void completion_wait(struct completion* c) {
+  uint32_t cpsr;
+
+  cpsr = save_interrupts();
+
+  while (!c->done) {
+    wait_queue_sleep(&c->wait);
+    restore_interrupts(cpsr);
+    cpsr = save_interrupts();
+  }
+
+  c->done = false;
+  restore_interrupts(cpsr);
+}
+
+/*
+  complete marks the completion "c" as done and wakes its waiters.
+*/
+void complete(struct completion* c) {
+  c->done = true;
+  wait_queue_wake(&c->wait);
+}
+
+/*
+  is_completion_done returns if the completion "c" is done.
+*/
+bool is_completion_done(const struct completion* c) {
+  return c->done;
+}
@@ -0,0 +1,47 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <kernel/list.h>
+#include <kernel/process.h>
+#include <stdbool.h>
+
+/* Should only be used for compile-time initialization. */
+#define WAIT_QUEUE_INIT(name) {LIST_INIT((name).waiters_head)}
+#define COMPLETION_INIT(name) {false, WAIT_QUEUE_INIT((name).wait)}
+
+/*
+  struct wait_entry represents a process "proc" which is sleeping on a wait
+  queue. It lives on the sleeping process's stack.
+*/
+struct wait_entry {
+  struct process_info* proc;
+  struct list_link link;
+};
+
+/*
+  struct wait_queue represents the processes which are sleeping until an event
+  happens. They are linked in "waiters_head".
+*/
+struct wait_queue {
+  struct list_link waiters_head;
+};
+
+/*
+  struct completion represents a single event which processes can wait for.
+  "done" is set when the event has happened and is consumed by the waiter.
+*/
+struct completion {
+  bool done;
+  struct wait_queue wait;
+};
+
+void wait_queue_init(struct wait_queue* wq);
+void wait_queue_sleep(struct wait_queue* wq);
+void wait_queue_wake(struct wait_queue* wq);
+
+void completion_init(struct completion* c);
+void completion_wait(struct completion* c);
+void complete(struct completion* c);
+bool is_completion_done(const struct completion* c);
+
+#endif
@@ -0,0 +1,48 @@
+#include <lib/mman.h>
+#include <lib/syscall.h>
+
+#define SYS_mmap 16
+#define SYS_munmap 17
+#define SYS_mprotect 18
+#define SYS_sync 19
+#define SYS_fsync 20
+
+/*
+  mmap maps "length" bytes with the memory protection flags "prot" and the
+  region map flags "flags" into the calling process, backed by the file
+  descriptor "fd" from the offset "offset" unless MAP_ANONYMOUS is set. It
+  returns the address of the mapping, or NULL on failure.
+*/
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset) {
+  return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+/*
+  munmap unmaps the "length" bytes from the address "addr".
+*/
+int munmap(void* addr, size_t length) {
+  return syscall(SYS_munmap, addr, length);
+}
+
+/*
+  mprotect changes the memory protection flags of the "length" bytes from the
+  address "addr" to "prot".
+*/
+int mprotect(void* addr, size_t length, int prot) {
+  return syscall(SYS_mprotect, addr, length, prot);
+}
+
+/*
+  sync writes every changed file block back to the filesystem.
+*/
+int sync() {
+  return syscall(SYS_sync);
+}
+
+/*
+  fsync writes the changed blocks of the file descriptor "fd" back to the
+  filesystem.
+*/
+int fsync(int fd) {
+  return syscall(SYS_fsync, fd);
+}
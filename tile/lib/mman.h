@@ -0,0 +1,26 @@
+#ifndef MMAN_H
+#define MMAN_H
+
+#include <stddef.h>
+
+/*
+  The memory protection flags and region map flags. They are the same as the
+  kernel's.
+*/
+#define PROT_NONE 0x0
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC 0x4
+
+#define MAP_SHARED 0x01
+#define MAP_PRIVATE 0x02
+#define MAP_FIXED 0x10
+#define MAP_ANONYMOUS 0x20
+
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, size_t offset);
+int munmap(void* addr, size_t length);
+int mprotect(void* addr, size_t length, int prot);
+int sync();
+int fsync(int fd);
+
+#endif
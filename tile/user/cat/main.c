@@ -2,7 +2,7 @@
 
 #define SYS_read 5
 #define SYS_write 6
-#define SYS_exit 16
+#define SYS_exit 15
 
 #define BUF_SIZE 256
 
@@ -0,0 +1,44 @@
+#include <lib/mman.h>
+#include <lib/syscall.h>
+
+#define SYS_open 4
+#define SYS_write 6
+#define SYS_close 7
+#define SYS_seek 10
+#define SYS_exit 15
+
+#define O_RDONLY 1
+
+#define MCAT_PATH "/sbin/init"
+
+/*
+  mcat writes a file to the terminal straight from a shared mapping of its
+  page cache pages, without reading it into a buffer first.
+*/
+int main() {
+  char* data;
+  int size;
+  int fd;
+
+  fd = syscall(SYS_open, MCAT_PATH, O_RDONLY);
+
+  if (fd < 0) {
+    syscall(SYS_exit, 1);
+  }
+
+  /* Seeking past the end of the file returns its size. */
+  size = syscall(SYS_seek, fd, -1);
+  syscall(SYS_seek, fd, 0);
+
+  data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  syscall(SYS_close, fd);
+
+  if (!data) {
+    syscall(SYS_exit, 1);
+  }
+
+  syscall(SYS_write, 1, data, size);
+  munmap(data, size);
+
+  syscall(SYS_exit, 0);
+}